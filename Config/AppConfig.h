@@ -47,4 +47,60 @@
 
 	#define DISK_READ_ONLY            false
 
+	/** Layout of the 176 bytes of endpoint memory, trading HID report size against Mass Storage
+	 *  throughput. The 8 byte control endpoint takes its share first:
+	 *  - 0: 16 byte Mass Storage endpoints, 64 byte HID reports (8 + 2*16 + 2*64 = 168 bytes)
+	 *  - 1: 64 byte Mass Storage endpoints, 16 byte HID reports (8 + 2*64 + 2*16 = 168 bytes)
+	 *  - 2: double-banked 32 byte Mass Storage endpoints, 16 byte HID reports (8 + 2*2*32 + 2*16 = 168 bytes)
+	 *
+	 *  HF2 works over 16 byte reports, but some host tools only handle the usual 64.
+	 */
+	#define ENDPOINT_LAYOUT           0
+
+	/** Time without writes from the host after which a flashing session is completed anyway, for
+	 *  UF2 files whose block counts never add up. Optiboot gives up on its own after 1 second without
+	 *  commands, so waiting much longer only keeps the serial port blocked. Must be under 4000.
+	 */
+	#define IDLE_COMMIT_MS            1000
+
+	/** Whether UF2 blocks in the EEPROM window at 0x810000 are programmed into the target EEPROM, in the
+	 *  same session as the flash. The optiboot shipped on the Uno ignores the memory type and would write
+	 *  them to flash, so this needs a bootloader with EEPROM support; when disabled, the blocks are skipped.
+	 */
+	#define TARGET_EEPROM_WRITES      false
+
+	/** Whether flash pages the target already holds are skipped, going by a CRC of each page kept in our
+	 *  EEPROM. The map only fits for the Uno, and goes stale if the target is programmed some other way,
+	 *  such as over ICSP.
+	 */
+	#define DIFFERENTIAL_FLASHING     true
+
+	/** Whether each page is read back from the target after programming and compared with what was sent,
+	 *  by CRC, re-sending it on a mismatch. This adds about half again to the time taken per page.
+	 */
+	#define VERIFY_PAGES              false
+
+	/** Whether the drive also holds CURRENT.UF2, the target flash as a UF2 file. Reading it resets the target
+	 *  into its bootloader, stopping the running sketch until about a second after the host stops reading -
+	 *  which happens whenever a search indexer, antivirus scanner or thumbnailer gets to the drive, not only
+	 *  when someone means to read it. Off by default for that reason.
+	 */
+	#define CURRENT_UF2_FILE          false
+
+	/** Whether the drive also holds FLASH.BIN, a raw image of the target flash. Writing to it at an offset
+	 *  programs those bytes of the flash and nothing else, with half the USB traffic of UF2. Such a session
+	 *  has no block count, so it completes after \c IDLE_COMMIT_MS without writes. Off by default, since
+	 *  whatever else the host puts in the clusters of FLASH.BIN gets programmed too - only sectors starting
+	 *  with the UF2 magic numbers are always taken for UF2 blocks. The Mega bootloader only takes pages in
+	 *  order from the start of the flash, so there a write has to start at offset 0 and go upwards, and
+	 *  the rest of the last page it touches is erased.
+	 */
+	#define FLASH_BIN_FILE            false
+
+	/** Whether HF2 runs over a vendor class bulk interface instead of HID, with Microsoft OS 2.0 descriptors
+	 *  so that Windows binds WinUSB to it without a driver. Bulk transfers are not limited to one packet per
+	 *  frame, but need a host tool that speaks HF2 over WinUSB or libusb rather than over HID.
+	 */
+	#define HF2_BULK                  false
+
 #endif
@@ -37,7 +37,7 @@
 
 #include "Descriptors.h"
 
-
+#if !HF2_BULK
 /** HID class report descriptor. This is a special descriptor constructed with values from the
  *  USBIF HID class specification to describe the reports and capabilities of the HID device. This
  *  descriptor is parsed by the host and its contents used to determine what data (and in what encoding)
@@ -63,6 +63,7 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM GenericReport[] =
     0xB1, 0x02,       // feature: data, variable, absolute
     0xC0,             // end
 };
+#endif
 
 
 
@@ -75,7 +76,8 @@ const USB_Descriptor_Device_t PROGMEM DeviceDescriptor =
 {
 	.Header                 = {.Size = sizeof(USB_Descriptor_Device_t), .Type = DTYPE_Device},
 
-	.USBSpecification       = VERSION_BCD(2,0,0),
+	/* Windows only asks for the BOS descriptor, and so the Microsoft OS 2.0 descriptors, from USB 2.1 devices */
+	.USBSpecification       = HF2_BULK ? VERSION_BCD(2,1,0) : VERSION_BCD(2,0,0),
 	.Class                  = USB_CSCP_IADDeviceClass,
 	.SubClass               = USB_CSCP_IADDeviceSubclass,
 	.Protocol               = USB_CSCP_IADDeviceProtocol,
@@ -161,13 +163,20 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 
 			.TotalEndpoints         = 2,
 
+			#if HF2_BULK
+			.Class                  = USB_CSCP_VendorSpecificClass,
+			.SubClass               = USB_CSCP_NoDeviceSubclass,
+			.Protocol               = USB_CSCP_NoDeviceProtocol,
+			#else
 			.Class                  = HID_CSCP_HIDClass,
 			.SubClass               = HID_CSCP_NonBootSubclass,
 			.Protocol               = HID_CSCP_NonBootProtocol,
+			#endif
 
 			.InterfaceStrIndex      = NO_DESCRIPTOR
 		},
 
+	#if !HF2_BULK
 	.HID_GenericHID =
 		{
 			.Header                 = {.Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID},
@@ -178,13 +187,14 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 			.HIDReportType          = HID_DTYPE_Report,
 			.HIDReportLength        = sizeof(GenericReport)
 		},
+	#endif
 
 	.HID_ReportINEndpoint =
 		{
 			.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
 
 			.EndpointAddress        = HID_IN_EPADDR,
-			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+			.Attributes             = (HID_IO_EPTYPE | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
 			.EndpointSize           = HID_IO_EPSIZE,
 			.PollingIntervalMS      = 0x01
 		},
@@ -194,7 +204,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 			.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
 
 			.EndpointAddress        = HID_OUT_EPADDR,
-			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+			.Attributes             = (HID_IO_EPTYPE | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
 			.EndpointSize           = HID_IO_EPSIZE,
 			.PollingIntervalMS      = 0x01
 		}
@@ -218,6 +228,86 @@ const USB_Descriptor_String_t PROGMEM ManufacturerString = USB_STRING_DESCRIPTOR
  */
 const USB_Descriptor_String_t PROGMEM ProductString = USB_STRING_DESCRIPTOR(L"UF2 MSD Bootloader");
 
+#if HF2_BULK
+/** Binary Device Object Store descriptor, read out by hosts from USB 2.1 devices. Its Microsoft OS 2.0 platform
+ *  capability tells Windows to fetch the Microsoft OS 2.0 descriptor set with a vendor request.
+ */
+const USB_Descriptor_BOS_t PROGMEM BOSDescriptor =
+{
+	.Length                 = 5,
+	.DescriptorType         = DTYPE_BinaryObjectStore,
+	.TotalLength            = sizeof(USB_Descriptor_BOS_t),
+	.NumDeviceCaps          = 1,
+
+	.MS_OS_20_Platform =
+		{
+			.Length                   = 28,
+			.DescriptorType           = DTYPE_DeviceCapability,
+			.DevCapabilityType        = DCTYPE_Platform,
+			.Reserved                 = 0,
+			/* {D8DD60DF-4589-4CC7-9CD2-659D9E648A9F}, little endian where the GUID has fields */
+			.PlatformCapabilityUUID   = {0xDF, 0x60, 0xDD, 0xD8, 0x89, 0x45, 0xC7, 0x4C,
+			                             0x9C, 0xD2, 0x65, 0x9D, 0x9E, 0x64, 0x8A, 0x9F},
+			.WindowsVersion           = MS_OS_20_WINDOWS_VERSION,
+			.DescriptorSetTotalLength = sizeof(MS_OS_20_DescriptorSet_t),
+			.VendorCode               = MS_OS_20_VENDOR_CODE,
+			.AltEnumCode              = 0
+		}
+};
+
+/** Microsoft OS 2.0 descriptor set, returned for the vendor request named in the BOS descriptor. It applies to the
+ *  HF2 interface only, as the Mass Storage interface keeps its class driver.
+ */
+const MS_OS_20_DescriptorSet_t PROGMEM MS_OS_20_DescriptorSet =
+{
+	.SetHeader =
+		{
+			.Length             = sizeof(MS_OS_20_DescriptorSet.SetHeader),
+			.DescriptorType     = MS_OS_20_SET_HEADER_DESCRIPTOR,
+			.WindowsVersion     = MS_OS_20_WINDOWS_VERSION,
+			.TotalLength        = sizeof(MS_OS_20_DescriptorSet_t)
+		},
+
+	.ConfigurationSubset =
+		{
+			.Length             = sizeof(MS_OS_20_DescriptorSet.ConfigurationSubset),
+			.DescriptorType     = MS_OS_20_SUBSET_HEADER_CONFIGURATION,
+			.ConfigurationValue = 0,
+			.Reserved           = 0,
+			.TotalLength        = sizeof(MS_OS_20_DescriptorSet_t) - sizeof(MS_OS_20_DescriptorSet.SetHeader)
+		},
+
+	.FunctionSubset =
+		{
+			.Length             = sizeof(MS_OS_20_DescriptorSet.FunctionSubset),
+			.DescriptorType     = MS_OS_20_SUBSET_HEADER_FUNCTION,
+			.FirstInterface     = INTERFACE_ID_GenericHID,
+			.Reserved           = 0,
+			.SubsetLength       = sizeof(MS_OS_20_DescriptorSet_t) - sizeof(MS_OS_20_DescriptorSet.SetHeader) -
+			                      sizeof(MS_OS_20_DescriptorSet.ConfigurationSubset)
+		},
+
+	.CompatibleID =
+		{
+			.Length             = sizeof(MS_OS_20_DescriptorSet.CompatibleID),
+			.DescriptorType     = MS_OS_20_FEATURE_COMPATIBLE_ID,
+			.CompatibleID       = "WINUSB",
+			.SubCompatibleID    = ""
+		},
+
+	.InterfaceGUIDs =
+		{
+			.Length             = sizeof(MS_OS_20_DescriptorSet.InterfaceGUIDs),
+			.DescriptorType     = MS_OS_20_FEATURE_REG_PROPERTY,
+			.PropertyDataType   = MS_OS_20_REG_MULTI_SZ,
+			.PropertyNameLength = sizeof(MS_OS_20_DescriptorSet.InterfaceGUIDs.PropertyName),
+			.PropertyName       = L"DeviceInterfaceGUIDs",
+			.PropertyDataLength = sizeof(MS_OS_20_DescriptorSet.InterfaceGUIDs.PropertyData),
+			.PropertyData       = L"{BFD744A7-9751-49DD-94EA-9C7131E8B191}\0"
+		}
+};
+#endif
+
 /** This function is called by the library when in device mode, and must be overridden (see library "USB Descriptors"
  *  documentation) by the application code so that the address and size of a requested descriptor can be given
  *  to the USB library. When the device receives a Get Descriptor request on the control endpoint, this function
@@ -263,6 +353,12 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 
 			break;
 
+		#if HF2_BULK
+		case DTYPE_BinaryObjectStore:
+			Address = &BOSDescriptor;
+			Size    = sizeof(USB_Descriptor_BOS_t);
+			break;
+		#else
 		case HID_DTYPE_HID:
 			Address = &ConfigurationDescriptor.HID_GenericHID;
 			Size    = sizeof(USB_HID_Descriptor_HID_t);
@@ -271,6 +367,7 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 			Address = &GenericReport;
 			Size    = sizeof(GenericReport);
 			break;
+		#endif
 	}
 
 	*DescriptorAddress = Address;
@@ -50,12 +50,67 @@
 		/** Endpoint address of the Mass Storage host-to-device data OUT endpoint. */
 		#define MASS_STORAGE_OUT_EPADDR        (ENDPOINT_DIR_OUT | 2)
 
-		/** Size in bytes of the Mass Storage data endpoints. */
-		#define MASS_STORAGE_IO_EPSIZE         16
-
 		#define HID_IN_EPADDR        (ENDPOINT_DIR_IN | 3)
 		#define HID_OUT_EPADDR        (ENDPOINT_DIR_OUT | 4)
-		#define HID_IO_EPSIZE         64
+
+		#if (ENDPOINT_LAYOUT == 0)
+			/** Size in bytes of the Mass Storage data endpoints. */
+			#define MASS_STORAGE_IO_EPSIZE         16
+
+			/** Number of banks of the Mass Storage data endpoints. */
+			#define MASS_STORAGE_IO_EPBANKS        1
+
+			#define HID_IO_EPSIZE         64
+		#elif (ENDPOINT_LAYOUT == 1)
+			#define MASS_STORAGE_IO_EPSIZE         64
+			#define MASS_STORAGE_IO_EPBANKS        1
+			#define HID_IO_EPSIZE         16
+		#elif (ENDPOINT_LAYOUT == 2)
+			#define MASS_STORAGE_IO_EPSIZE         32
+			#define MASS_STORAGE_IO_EPBANKS        2
+			#define HID_IO_EPSIZE         16
+		#else
+			#error Unknown ENDPOINT_LAYOUT.
+		#endif
+
+		#if (FIXED_CONTROL_ENDPOINT_SIZE + 2 * MASS_STORAGE_IO_EPSIZE * MASS_STORAGE_IO_EPBANKS + 2 * HID_IO_EPSIZE) > 176
+			#error Endpoints do not fit in the 176 bytes of endpoint memory.
+		#endif
+
+		#if HF2_BULK
+			/** Type of the HF2 endpoints, which keep the HID names and sizes. */
+			#define HID_IO_EPTYPE                  EP_TYPE_BULK
+
+			/** Descriptor types of the USB 2.1 Binary Device Object Store, which carries the Microsoft OS 2.0
+			 *  platform capability.
+			 */
+			#define DTYPE_BinaryObjectStore        0x0F
+			#define DTYPE_DeviceCapability         0x10
+
+			/** Device capability type of a platform capability descriptor. */
+			#define DCTYPE_Platform                0x05
+
+			/** Vendor request code with which Windows fetches the Microsoft OS 2.0 descriptor set. */
+			#define MS_OS_20_VENDOR_CODE           0x20
+
+			/** wIndex of the vendor request for the Microsoft OS 2.0 descriptor set. */
+			#define MS_OS_20_DESCRIPTOR_INDEX      0x07
+
+			/** Windows version the Microsoft OS 2.0 descriptors apply from, Windows 8.1. */
+			#define MS_OS_20_WINDOWS_VERSION       0x06030000UL
+
+			/** Microsoft OS 2.0 descriptor types. */
+			#define MS_OS_20_SET_HEADER_DESCRIPTOR 0x00
+			#define MS_OS_20_SUBSET_HEADER_CONFIGURATION 0x01
+			#define MS_OS_20_SUBSET_HEADER_FUNCTION 0x02
+			#define MS_OS_20_FEATURE_COMPATIBLE_ID 0x03
+			#define MS_OS_20_FEATURE_REG_PROPERTY  0x04
+
+			/** Registry value type of a list of strings. */
+			#define MS_OS_20_REG_MULTI_SZ          7
+		#else
+			#define HID_IO_EPTYPE                  EP_TYPE_INTERRUPT
+		#endif
 
 	/* Type Defines: */
 		/** Type define for the device configuration descriptor structure. This must be defined in the
@@ -71,11 +126,90 @@
 			USB_Descriptor_Endpoint_t                MS_DataInEndpoint;
 			USB_Descriptor_Endpoint_t                MS_DataOutEndpoint;
 			USB_Descriptor_Interface_t            HID_Interface;
+			#if !HF2_BULK
 			USB_HID_Descriptor_HID_t              HID_GenericHID;
+			#endif
 			USB_Descriptor_Endpoint_t             HID_ReportINEndpoint;
 			USB_Descriptor_Endpoint_t             HID_ReportOUTEndpoint;
 		} USB_Descriptor_Configuration_t;
 
+		#if HF2_BULK
+		/** Type define for the Binary Device Object Store, with the platform capability through which Windows
+		 *  finds the Microsoft OS 2.0 descriptor set.
+		 */
+		typedef struct
+		{
+			uint8_t  Length;
+			uint8_t  DescriptorType;
+			uint16_t TotalLength;
+			uint8_t  NumDeviceCaps;
+
+			struct
+			{
+				uint8_t  Length;
+				uint8_t  DescriptorType;
+				uint8_t  DevCapabilityType;
+				uint8_t  Reserved;
+				uint8_t  PlatformCapabilityUUID[16];
+				uint32_t WindowsVersion;
+				uint16_t DescriptorSetTotalLength;
+				uint8_t  VendorCode;
+				uint8_t  AltEnumCode;
+			} ATTR_PACKED MS_OS_20_Platform;
+		} ATTR_PACKED USB_Descriptor_BOS_t;
+
+		/** Type define for the Microsoft OS 2.0 descriptor set, which has Windows bind WinUSB to the HF2
+		 *  interface and give it a device interface GUID for host tools to find it by.
+		 */
+		typedef struct
+		{
+			struct
+			{
+				uint16_t Length;
+				uint16_t DescriptorType;
+				uint32_t WindowsVersion;
+				uint16_t TotalLength;
+			} ATTR_PACKED SetHeader;
+
+			struct
+			{
+				uint16_t Length;
+				uint16_t DescriptorType;
+				uint8_t  ConfigurationValue;
+				uint8_t  Reserved;
+				uint16_t TotalLength;
+			} ATTR_PACKED ConfigurationSubset;
+
+			struct
+			{
+				uint16_t Length;
+				uint16_t DescriptorType;
+				uint8_t  FirstInterface;
+				uint8_t  Reserved;
+				uint16_t SubsetLength;
+			} ATTR_PACKED FunctionSubset;
+
+			struct
+			{
+				uint16_t Length;
+				uint16_t DescriptorType;
+				char     CompatibleID[8];
+				char     SubCompatibleID[8];
+			} ATTR_PACKED CompatibleID;
+
+			struct
+			{
+				uint16_t Length;
+				uint16_t DescriptorType;
+				uint16_t PropertyDataType;
+				uint16_t PropertyNameLength;
+				wchar_t  PropertyName[21];
+				uint16_t PropertyDataLength;
+				wchar_t  PropertyData[40];
+			} ATTR_PACKED InterfaceGUIDs;
+		} ATTR_PACKED MS_OS_20_DescriptorSet_t;
+		#endif
+
 		/** Enum for the device interface descriptor IDs within the device. Each interface descriptor
 		 *  should have a unique ID index associated with it, which can be used to refer to the
 		 *  interface from other descriptors.
@@ -97,6 +231,11 @@
 			STRING_ID_Product      = 2, /**< Product string ID */
 		};
 
+	/* External Variables: */
+		#if HF2_BULK
+		extern const MS_OS_20_DescriptorSet_t MS_OS_20_DescriptorSet;
+		#endif
+
 	/* Function Prototypes: */
 		uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 		                                    const uint16_t wIndex,
@@ -1,58 +1,641 @@
 #define INCLUDE_FROM_DATAFLASHMANAGER_C
 #include "DataflashManager.h"
 
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
 const uint8_t uf2magic[] PROGMEM = "UF2\nWQ]\x9E";
 
-// 32k flash, 256b payload, +20% overhead
-#define MAX_BLOCKS ((32 * (1024 / 256)) * 5 / 4)
+#define UF2_FLAG_NOFLASH 0x00000001
+// the last header word holds the family ID rather than the file size
+#define UF2_FLAG_FAMILYID_PRESENT 0x00002000
+#define UF2_MAGIC_END 0x0AB16F30
+
+// where avr-gcc puts the .eeprom section, and so where UF2 files made from its output carry the
+// EEPROM contents
+#define EEPROM_BASE 0x810000
+// the flash below the bootloader, which is all it can write
+#define APP_FLASH_SIZE (TARGET_FLASH_SIZE - TARGET_BOOTLOADER_SIZE)
+
+// the largest UF2 file a session takes, with payloads down to 64b
+#define MAX_BLOCKS ((TARGET_FLASH_SIZE + TARGET_EEPROM_SIZE) / 64)
+// written blocks are tracked as runs of consecutive block numbers; files are normally written in
+// order, in which case a single run covers the whole file
+#define MAX_RUNS 4
+// numBlocks of a file whose block count is unknown, which only completes once the host stops
+// writing for IDLE_COMMIT_MS
+#define NUM_BLOCKS_UNKNOWN 0xffff
 
-#if MAX_BLOCKS >= 255
+#if MAX_BLOCKS >= NUM_BLOCKS_UNKNOWN
 #error too high max blocks?
 #endif
 
-#define PAGE_SHIFT 7
-
-#if SPM_PAGESIZE != 128
+// page offsets are bytes
+#if TARGET_CHUNKSIZE & (TARGET_CHUNKSIZE - 1) || TARGET_CHUNKSIZE > 128
 #error unsupported page size
 #endif
 
-#if (SPM_PAGESIZE >> PAGE_SHIFT) != 1
-#error unsupported page size
+// measured on TIMER1, which wraps every 4 seconds
+#if IDLE_COMMIT_MS >= 4000
+#error too long idle commit time
 #endif
 
-#define BLOCKS_PAR_PAGE (SPM_PAGESIZE / MASS_STORAGE_IO_EPSIZE)
+// blocks are read in chunks of the smallest endpoint size, so that a bank never ends mid-chunk
+#define READ_CHUNK 16
+// the 32 byte UF2 header, followed by up to 476 bytes of payload and the final magic number
+#define HEADER_SIZE 32
+#define MAX_PAYLOAD (512 - HEADER_SIZE)
+
+#if MASS_STORAGE_IO_EPSIZE % READ_CHUNK
+#error unsupported endpoint size
+#endif
+
+// pages of the application section, which the bootloader can write
+#define CRC_MAP_PAGES (APP_FLASH_SIZE / TARGET_CHUNKSIZE)
+// the map and its generation have to fit in our EEPROM, which they do on the Uno only
+#define CRC_MAP (DIFFERENTIAL_FLASHING && (CRC_MAP_PAGES + 1) * 2 <= E2END + 1)
+// map entry of a page whose contents are unknown
+#define CRC_UNKNOWN 0xffff
+
+#define NUM_FAT_BLOCKS VIRTUAL_MEMORY_BLOCKS
+
+#define RESERVED_SECTORS 1
+#define ROOT_DIR_SECTORS 4
+#define SECTORS_PER_FAT ((NUM_FAT_BLOCKS * 2 + 511) / 512)
+
+#define START_FAT0 RESERVED_SECTORS
+#define START_FAT1 (START_FAT0 + SECTORS_PER_FAT)
+#define START_ROOTDIR (START_FAT1 + SECTORS_PER_FAT)
+#define START_CLUSTERS (START_ROOTDIR + ROOT_DIR_SECTORS)
 
-#define CRC_EOP 0x20          // 'SPACE'
-#define STK_PROG_PAGE 0x64    // 'd'
-#define STK_LOAD_ADDRESS 0x55 // 'U'
+#define NUM_INFO 2
+
+// CURRENT.UF2 holds the whole target flash, in blocks of the usual payload size, in the clusters
+// after the info files - none at all without CURRENT_UF2_FILE
+#define CURRENT_UF2_PAYLOAD 256
+#define CURRENT_UF2_BLOCKS (TARGET_FLASH_SIZE / CURRENT_UF2_PAYLOAD)
+#define CURRENT_UF2_CLUSTER (2 + NUM_INFO)
+#define CURRENT_UF2_END (CURRENT_UF2_CLUSTER + (CURRENT_UF2_FILE ? CURRENT_UF2_BLOCKS : 0))
+
+#if CURRENT_UF2_PAYLOAD % TARGET_CHUNKSIZE
+#error unsupported page size for CURRENT.UF2
+#endif
+
+// FLASH.BIN maps the target flash straight onto the clusters after CURRENT.UF2, if any, a sector
+// to 512 bytes of flash
+#define FLASH_BIN_CLUSTER CURRENT_UF2_END
+#define FLASH_BIN_END (FLASH_BIN_CLUSTER + TARGET_FLASH_SIZE / 512)
+#define FLASH_BIN_SECTOR (START_CLUSTERS + FLASH_BIN_CLUSTER - 2)
+
+// end of the clusters in use
+#define CLUSTERS_END (FLASH_BIN_FILE ? FLASH_BIN_END : CURRENT_UF2_END)
 
 static uint16_t numBlocksWritten;
-static uint8_t numBlocks;
-static uint8_t writtenMask[MAX_BLOCKS / 8];
+static uint16_t numBlocks;
+static bool mediaChanged;
+// TIMER1 time at the end of the last write command, or of the last read one outside a flashing
+// session
+static uint16_t lastAccessTime;
 
-static void targetReset(void) {
-    AVR_RESET_LINE_PORT &= ~AVR_RESET_LINE_MASK;
-    _delay_ms(10);
-    AVR_RESET_LINE_PORT |= AVR_RESET_LINE_MASK;
-}
+// where the target stands for CURRENT.UF2 and FLASH.BIN to be read, until the host stops reading:
+// running the sketch; in its bootloader, with pageAddr holding the address of the page read, or
+// being read, into the page buffer; or with no bootloader answering, in which case the rest of the
+// reads are 0xff straight away rather than another round of resets each
+#define READBACK_NONE 0
+#define READBACK_ACTIVE 1
+#define READBACK_FAILED 2
+static uint8_t readback;
 
-extern volatile uint8_t recv_STK_OK;
+// blocks of the file written so far, as sorted runs [start, end) with gaps between them
+typedef struct {
+    uint16_t start;
+    uint16_t end;
+} BlockRun;
+static BlockRun runs[MAX_RUNS];
+static uint8_t numRuns;
+// set once the blocks of the file are too far out of order to track, so that it only completes
+// once the host stops writing
+static bool untracked;
+// set once the last block of the file has been written, after which block 0 starts the next file
+static bool lastBlockWritten;
 
-static void finishPacket(void) {
-    recv_STK_OK = 0;
-    Serial_SendByte(CRC_EOP);
+// the page being assembled - a whole flash page, or half of one on the Mega - kept until the target
+// acknowledges it so it can be re-sent, or on the Mega until it has gone out; a payload that ends
+// mid-page leaves it open for the next block to fill
+static uint8_t pageBuffer[TARGET_CHUNKSIZE];
+static uint32_t pageAddr;
+static bool pageOpen;
+// bytes of the page the blocks have covered so far, [pageStart, pageEnd)
+static uint8_t pageStart;
+static uint8_t pageEnd;
 
-    logChar('P');
+// set once the target stops acknowledging pages, for the rest of the write command
+static bool failed;
 
-    wdt_enable(WDTO_250MS);
+#if TARGET_SEQUENTIAL_PAGES
+// flash address of the next chunk the bootloader takes, counting from 0 as it does since it started
+static uint32_t flashEnd;
+#endif
 
-    while (!recv_STK_OK)
+#if CRC_MAP
+// CRC of each page of the target flash as last acknowledged, XORed with the map generation; bumping
+// the generation invalidates the whole map with a single write
+static uint16_t crcMap[CRC_MAP_PAGES] EEMEM;
+static uint16_t crcMapGeneration EEMEM;
+
+// map entry of the page being programmed, and the value it gets once the target acknowledges it
+static uint16_t *crcEntry;
+static uint16_t crcTag;
+#endif
+
+/** Starts tracking the blocks of another UF2 file, within the flashing session in progress if any.
+ *
+ *  \param[in] count  Number of blocks in the file, or \c NUM_BLOCKS_UNKNOWN
+ */
+static void beginFile(uint16_t count) {
+    numBlocks = count;
+    numBlocksWritten = 0;
+    numRuns = 0;
+    untracked = false;
+    lastBlockWritten = false;
+}
+
+/** Forgets all UF2 blocks seen so far, so that the next UF2 file starts a fresh flashing session. */
+static void resetSession(void) {
+    beginFile(0);
+    pageOpen = false;
+}
+
+/** Records a UF2 block as written in the current file. Once there are more gaps between the
+ *  blocks written so far than the tracker can hold, duplicates can no longer be told apart, so
+ *  the file stops counting towards completion.
+ *
+ *  \param[in] x  UF2 block number
+ *
+ *  \return Boolean \c true if the block is new to the file, \c false if it was already written
+ */
+static bool markBlock(uint16_t x) {
+    uint8_t i;
+
+    // first run that ends at or after the block
+    for (i = 0; i < numRuns && runs[i].end < x; ++i)
         ;
 
-    // we've sent some packets
-    // if we see no action in next 1S, the optiboot is going to stop anyway, so we may as well reset
-    // ourselves
-    wdt_enable(WDTO_1S);
+    if (i < numRuns) {
+        if (x >= runs[i].start && x < runs[i].end)
+            return false;
+
+        // the next block in order - the usual case
+        if (x == runs[i].end) {
+            runs[i].end++;
+            if (i + 1 < numRuns && runs[i + 1].start == runs[i].end) {
+                runs[i].end = runs[i + 1].end;
+                numRuns--;
+                memmove(&runs[i + 1], &runs[i + 2], (numRuns - i - 1) * sizeof(runs[0]));
+            }
+            return true;
+        }
+
+        if (x + 1 == runs[i].start) {
+            runs[i].start--;
+            return true;
+        }
+    }
+
+    if (numRuns == MAX_RUNS) {
+        if (!untracked)
+            Counters.TrackerOverflows++;
+        untracked = true;
+        return true;
+    }
+
+    memmove(&runs[i + 1], &runs[i], (numRuns - i) * sizeof(runs[0]));
+    runs[i].start = x;
+    runs[i].end = x + 1;
+    numRuns++;
+    return true;
+}
+
+/** Checks whether the virtual disk contents changed under the host since the last call, which
+ *  happens once a flashing session completes.
+ *
+ *  \return Boolean \c true once after each completed flashing session, \c false otherwise
+ */
+bool DataflashManager_CheckMediaChanged(void) {
+    bool changed = mediaChanged;
+    mediaChanged = false;
+    return changed;
+}
+
+/** Lets the target finish the STK500 command sequence in progress, keeping USB and the HF2
+ *  interface serviced meanwhile - a write command waits on the target for every page, which adds
+ *  up to seconds. \c HID_Task() reads and writes its packets straight from the endpoint banks, so
+ *  it adds little to the stack here, and refuses the reset commands while the target is taken.
+ *
+ *  \return Boolean \c true if the last command sequence succeeded, \c false otherwise
+ */
+static bool waitForTarget(void) {
+    bool ok;
+
+    if (STK500_IsBusy() || HID_IsResetting()) {
+        uint8_t endpoint = Endpoint_GetCurrentEndpoint();
+
+        // an HF2 reset has the target until its reply is out
+        while (STK500_IsBusy() || HID_IsResetting()) {
+            STK500_Task();
+            USB_USBTask();
+            HID_Task();
+        }
+
+        Endpoint_SelectEndpoint(endpoint);
+    }
+
+    ok = STK500_Result();
+
+#if CRC_MAP
+    // a page only goes in the map once the target has acknowledged it
+    if (crcEntry) {
+        if (ok)
+            eeprom_update_word(crcEntry, crcTag);
+        crcEntry = NULL;
+    }
+#endif
+
+    return ok;
+}
+
+#if CRC_MAP
+/** Checks the page being assembled against the CRC map, to tell whether the target already holds
+ *  it. Otherwise the page is set up to go in the map once the target acknowledges it.
+ *
+ *  \return Boolean \c true if the page is unchanged since it was last programmed, \c false otherwise
+ */
+static bool isPageUnchanged(void) {
+    uint16_t crc = 0xffff;
+
+    if (pageAddr >= CRC_MAP_PAGES * TARGET_CHUNKSIZE)
+        return false;
+
+    for (uint16_t i = 0; i < TARGET_CHUNKSIZE; ++i)
+        crc = _crc_ccitt_update(crc, pageBuffer[i]);
+
+    crcEntry = &crcMap[pageAddr / TARGET_CHUNKSIZE];
+    crcTag = crc ^ eeprom_read_word(&crcMapGeneration);
+
+    if (crcTag != CRC_UNKNOWN && eeprom_read_word(crcEntry) == crcTag) {
+        crcEntry = NULL;
+        return true;
+    }
+
+    return false;
+}
+#endif
+
+/** Forgets what the target flash holds, so that every page is programmed again. Call this whenever
+ *  the target may get programmed behind our back.
+ */
+void DataflashManager_InvalidateCrcMap(void) {
+#if CRC_MAP
+    eeprom_update_word(&crcMapGeneration, eeprom_read_word(&crcMapGeneration) + 1);
+#endif
+}
+
+#if !TARGET_SEQUENTIAL_PAGES
+/** Reads the bytes of the flash page being assembled that no block has covered from the target, so
+ *  that programming the page leaves them as they are. Flash is read in whole words, so the covered
+ *  bytes at either end, which may share a word with an uncovered one, are put back afterwards.
+ *
+ *  \return Boolean \c true if the target could be read, \c false otherwise
+ */
+static bool fillPage(void) {
+    uint8_t first = pageBuffer[pageStart];
+    uint8_t last = pageBuffer[pageEnd - 1];
+    uint8_t start = (pageStart + 1) & ~1;
+    uint8_t end = pageEnd & ~1;
+    bool ok = true;
+
+    if (start) {
+        STK500_BeginReadPage(STK_MEMTYPE_FLASH, pageAddr, pageBuffer, start);
+        ok = waitForTarget();
+    }
+
+    if (ok && end < TARGET_CHUNKSIZE) {
+        STK500_BeginReadPage(STK_MEMTYPE_FLASH, pageAddr + end, pageBuffer + end,
+                             TARGET_CHUNKSIZE - end);
+        ok = waitForTarget();
+    }
+
+    pageBuffer[pageStart] = first;
+    pageBuffer[pageEnd - 1] = last;
+    return ok;
+}
+#else
+/** Sends the next chunk of flash to the bootloader, starting a page or going on with one.
+ *
+ *  \param[in] data  Contents of the chunk, or \c NULL for erased flash
+ */
+static void programChunk(const uint8_t *data) {
+    if (flashEnd & (TARGET_PAGESIZE - 1))
+        STK500_BeginProgramChunk(data, TARGET_CHUNKSIZE);
+    else
+        STK500_BeginProgramPage(STK_MEMTYPE_FLASH, flashEnd, data, TARGET_CHUNKSIZE,
+                                TARGET_PAGESIZE);
+    flashEnd += TARGET_CHUNKSIZE;
+}
+
+/** Completes the flash page the bootloader is in the middle of with erased bytes, so that it takes
+ *  other commands again. The target must have finished the chunk before.
+ *
+ *  \return Boolean \c true if the target acknowledged the page, \c false otherwise
+ */
+static bool endPage(void) {
+    while (flashEnd & (TARGET_PAGESIZE - 1)) {
+        programChunk(NULL);
+        if (!waitForTarget())
+            return false;
+    }
+
+    return true;
+}
+
+/** Gets the bootloader to where it takes the chunk at \p addr next: over a gap with erased chunks,
+ *  as avrdude fills the gaps of a file, or back to address 0 for the next file by resetting it.
+ *  Going back anywhere else, or starting anywhere but the first page, would have the bootloader
+ *  erase pages the host never wrote, so it is refused. The target must have finished the chunk
+ *  before.
+ *
+ *  \param[in] addr  Byte address of the chunk
+ *
+ *  \return Boolean \c true if the chunk can go out next, \c false otherwise
+ */
+static bool seekChunk(uint32_t addr) {
+    if (addr < flashEnd && !addr) {
+        if (!endPage())
+            return false;
+        STK500_BeginEnterBootloader();
+        if (!waitForTarget())
+            return false;
+        flashEnd = 0;
+    }
+
+    if (addr < flashEnd || (!flashEnd && addr >= TARGET_PAGESIZE)) {
+        logChar('O');
+        Counters.OutOfOrderPages++;
+        return false;
+    }
+
+    while (flashEnd < addr) {
+        programChunk(NULL);
+        if (!waitForTarget())
+            return false;
+    }
+
+    return true;
+}
+#endif
+
+/** Sends the page being assembled to the target, unless it already holds it. A flash page the
+ *  blocks only partly cover is first completed from the target - or on the Mega, which can't be
+ *  read in the middle of a page, with erased bytes as avrdude does - while of an EEPROM page only
+ *  the covered bytes are written. The page buffer must stay untouched until the target has
+ *  acknowledged it.
+ */
+static void flushPage(void) {
+    if (!pageOpen)
+        return;
+
+    pageOpen = false;
+
+    // once the target is lost, the rest of the data is drained but not programmed
+    if (failed)
+        return;
+
+    // EEPROM is written a byte at a time, so only the bytes the blocks cover are sent
+    if (pageAddr >= EEPROM_BASE) {
+#if TARGET_SEQUENTIAL_PAGES
+        if (!endPage()) {
+            failed = true;
+            return;
+        }
+#endif
+        STK500_BeginProgramPage(STK_MEMTYPE_EEPROM, pageAddr - EEPROM_BASE + pageStart,
+                                pageBuffer + pageStart, pageEnd - pageStart, pageEnd - pageStart);
+        return;
+    }
+
+#if TARGET_SEQUENTIAL_PAGES
+    memset(pageBuffer, 0xff, pageStart);
+    memset(pageBuffer + pageEnd, 0xff, TARGET_CHUNKSIZE - pageEnd);
+
+    if (!seekChunk(pageAddr)) {
+        failed = true;
+        return;
+    }
+
+    programChunk(pageBuffer);
+#else
+    // the target has finished the page before this one, when it was opened
+    if ((pageStart || pageEnd != TARGET_CHUNKSIZE) && !fillPage()) {
+        failed = true;
+        return;
+    }
+
+#if CRC_MAP
+    if (isPageUnchanged()) {
+        Counters.SkippedPages++;
+        return;
+    }
+#endif
+
+    STK500_BeginProgramPage(STK_MEMTYPE_FLASH, pageAddr, pageBuffer, TARGET_CHUNKSIZE,
+                            TARGET_CHUNKSIZE);
+
+#if CRC_MAP
+    // what the target holds is unknown until it acknowledges the page - written to the map while
+    // the page goes out
+    if (crcEntry)
+        eeprom_update_word(crcEntry, CRC_UNKNOWN);
+#endif
+#endif
+}
+
+/** Starts assembling the page holding the given address from that address on, sending out the
+ *  page assembled so far.
+ *
+ *  \param[in] addr  Byte address in the target flash
+ */
+static void openPage(uint32_t addr) {
+    flushPage();
+
+    // the previous page has to be on the target before its buffer can be overwritten
+    if (!waitForTarget())
+        failed = true;
+
+    pageAddr = addr & ~(TARGET_CHUNKSIZE - 1);
+    pageStart = pageEnd = addr & (TARGET_CHUNKSIZE - 1);
+    pageOpen = true;
+}
+
+/** Sends out the last page of the session and gets the target out of its bootloader, starting
+ *  the new application.
+ */
+static void finishSession(void) {
+    flushPage();
+    waitForTarget();
+#if TARGET_SEQUENTIAL_PAGES
+    // left in the middle of a page, the bootloader takes the leave command for page data and never
+    // answers it, and the target is reset the slow way instead
+    endPage();
+#endif
+    STK500_BeginStartApp();
+    waitForTarget();
+    resetSession();
+    mediaChanged = true;
+}
+
+/** Makes sure the endpoint holds unread data, moving on to the next packet from the host once the
+ *  current one has been read out.
+ *
+ *  \return Boolean \c true if the transfer was aborted by the host, \c false otherwise
+ */
+static bool nextPacket(void) {
+    /* Clear the current endpoint bank once it has been read out - a discarded one is already gone */
+    if (Endpoint_IsOUTReceived() && !(Endpoint_IsReadWriteAllowed()))
+        Endpoint_ClearOUT();
+
+    /* Wait until the host has sent another packet */
+    if (!(Endpoint_IsOUTReceived()) && Endpoint_WaitUntilReady())
+        return true;
+
+    /* Check if the current command is being aborted by the host */
+    return IsMassStoreReset;
+}
+
+/** Drops the next \p count bytes from the host without looking at them, a whole bank at a time. The
+ *  blocks are a whole number of banks long, so the rest of a bank never belongs to the next block.
+ *
+ *  \return Boolean \c true if the transfer was aborted by the host, \c false otherwise
+ */
+static bool discardBytes(uint16_t count) {
+    while (count) {
+        if (nextPacket())
+            return true;
+
+        uint16_t n = Endpoint_BytesInEndpoint();
+        count = n < count ? count - n : 0;
+
+        /* Hand the whole bank back to the USB controller without reading it out */
+        Endpoint_ClearOUT();
+    }
+
+    return IsMassStoreReset;
+}
+
+/** Checks the start of a block, straight from the endpoint, for the UF2 magic numbers. Reads no
+ *  further than the first byte that differs, so that the caller can still make use of the block.
+ *
+ *  \param[out] b  First byte that differs from the magic numbers, if any
+ *
+ *  \return Number of bytes matching the magic numbers, 8 for a UF2 block
+ */
+static uint8_t matchUF2Magic(uint8_t *b) {
+    uint8_t i;
+
+    for (i = 0; i < 8; ++i) {
+        *b = Endpoint_Read_8();
+        if (*b != pgm_read_byte(uf2magic + i))
+            break;
+    }
+
+    return i;
+}
+
+/** Checks whether \p count bytes from \p addr on all lie in the \p size bytes from \p base on,
+ *  without overflowing on addresses near the top of the address space.
+ */
+static bool inRegion(uint32_t addr, uint16_t count, uint32_t base, uint32_t size) {
+    return addr - base < size && count <= size - (addr - base);
+}
+
+/** Gets the target into its bootloader for the first data of a flashing session, while the host
+ *  sends us the rest of it.
+ */
+static void beginSession(void) {
+    if (numBlocks)
+        return;
+
+    waitForTarget();
+    readback = READBACK_NONE;
+    STK500_BeginEnterBootloader();
+#if TARGET_SEQUENTIAL_PAGES
+    flashEnd = 0;
+#endif
+}
+
+/** Puts a byte in its place in the page, at any offset - a page is sent to the target once its
+ *  end is reached, or once a block leaves a gap in it.
+ *
+ *  \param[in] addr  Byte address, in the flash or the EEPROM window
+ *  \param[in] b     Byte to program
+ */
+static void programByte(uint32_t addr, uint8_t b) {
+    uint8_t off = addr & (TARGET_CHUNKSIZE - 1);
+
+    if (!pageOpen || (addr & ~(TARGET_CHUNKSIZE - 1)) != pageAddr || off < pageStart ||
+        off > pageEnd)
+        openPage(addr);
+
+    pageBuffer[off] = b;
+    if (off == pageEnd)
+        pageEnd++;
+
+    if (off == TARGET_CHUNKSIZE - 1)
+        flushPage();
+}
+
+/** Programs the next \p count bytes from the endpoint into the target from \p addr on, straight
+ *  from the endpoint to their place in the page.
+ *
+ *  \param[in] addr   Byte address of the first byte, in the flash or the EEPROM window
+ *  \param[in] count  Number of bytes to program, starting on a \c READ_CHUNK boundary of the block
+ *
+ *  \return Boolean \c true if the transfer was aborted by the host, \c false otherwise
+ */
+static bool programBytes(uint32_t addr, uint16_t count) {
+    for (uint16_t i = 0; i < count; ++i) {
+        if (!(i & (READ_CHUNK - 1)) && nextPacket())
+            return true;
+
+        programByte(addr++, Endpoint_Read_8());
+    }
+
+    return false;
+}
+
+/** Programs a FLASH.BIN sector from \p addr on, whose first bytes were read already while checking
+ *  it for the UF2 magic numbers. There is no block count to complete on, so the session ends once
+ *  the host stops writing.
+ *
+ *  \param[in] addr     Byte address of the sector in the flash
+ *  \param[in] matched  Number of bytes read that match the magic numbers
+ *  \param[in] b        The byte read after them
+ *
+ *  \return Boolean \c true if the transfer was aborted by the host, \c false otherwise
+ */
+static bool programSector(uint32_t addr, uint8_t matched, uint8_t b) {
+    beginSession();
+    numBlocks = NUM_BLOCKS_UNKNOWN;
+
+    // the rest of the first chunk is in the same bank
+    for (uint8_t i = 0; i < READ_CHUNK; ++i) {
+        if (i < matched)
+            b = pgm_read_byte(uf2magic + i);
+        else if (i > matched)
+            b = Endpoint_Read_8();
+        programByte(addr + i, b);
+    }
+
+    return programBytes(addr + READ_CHUNK, 512 - READ_CHUNK);
 }
 
 /** Writes blocks (OS blocks, not Dataflash pages) to the storage medium, the board Dataflash IC(s),
@@ -61,136 +644,196 @@ static void finishPacket(void) {
  * writes
  *  them to the Dataflash in Dataflash page sized blocks.
  *
- *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration
- * and state
  *  \param[in] BlockAddress  Data block starting address for the write sequence
  *  \param[in] TotalBlocks   Number of blocks of data to write
+ *
+ *  \return Boolean \c false if the target could not be programmed, \c true otherwise
  */
-void DataflashManager_WriteBlocks(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo,
-                                  const uint32_t BlockAddress, uint16_t TotalBlocks) {
-    uint8_t buf[MASS_STORAGE_IO_EPSIZE];
-    uint8_t isUF2 = 0;
-    uint16_t addr = 0;
-    uint8_t i;
-    uint8_t numPages = 0;
+bool DataflashManager_WriteBlocks(const uint32_t BlockAddress, uint16_t TotalBlocks) {
+    uint32_t addr;
+    uint16_t payloadSize;
+    uint32_t lba = BlockAddress;
+    uint32_t tmp;
+    uint32_t flags;
+
+    failed = false;
 
     /* Wait until endpoint is ready before continuing */
     if (Endpoint_WaitUntilReady())
-        return;
+        return true;
 
     while (TotalBlocks) {
         logChar('w');
-        
-        for (uint8_t bufno = 0; bufno < 512 / MASS_STORAGE_IO_EPSIZE; ++bufno) {
-            /* Check if the endpoint is currently empty */
-            if (!(Endpoint_IsReadWriteAllowed())) {
-                /* Clear the current endpoint bank */
-                Endpoint_ClearOUT();
-
-                /* Wait until the host has sent another packet */
-                if (Endpoint_WaitUntilReady())
-                    return;
-            }
-
-            for (i = 0; i < MASS_STORAGE_IO_EPSIZE; ++i)
-                buf[i] = Endpoint_Read_8();
 
-            /* Check if the current command is being aborted by the host */
-            if (MSInterfaceInfo->State.IsMassStoreReset)
-                return;
+        /* Decrement the blocks remaining counter */
+        TotalBlocks--;
 
-            if (bufno == 0) {
-                isUF2 = 1;
-                for (i = 0; i < 8; ++i) {
-                    if (buf[i] != pgm_read_byte(uf2magic + i)) {
-                        isUF2 = 0;
-                        break;
-                    }
-                }
-                if (buf[8] & 1)
-                    isUF2 = 0; // UF2 do not flash flag
+        // the FAT and root directory sit below the data area, and never hold UF2 blocks
+        if (lba < START_CLUSTERS) {
+            lba++;
+            if (discardBytes(512))
+                return true;
+            continue;
+        }
 
-                addr = *(uint16_t *)(buf + 12);
-                // STK500 address is in words, not bytes
-                addr >>= 1;
-            }
+        // sector within FLASH.BIN, which wraps round for the clusters before it
+        uint32_t sector = lba++ - FLASH_BIN_SECTOR;
 
-            if (!isUF2)
-                continue;
+        if (nextPacket())
+            return true;
 
-            if (bufno == 1) {
-                numPages = *(uint16_t *)(buf + 0) >> PAGE_SHIFT;
+        uint8_t b;
+        uint8_t matched = matchUF2Magic(&b);
 
-                uint32_t tmp = *(uint32_t *)(buf + 24 - 16);
-                if (tmp != numBlocks) {
-                    if (tmp > MAX_BLOCKS || numBlocks)
-                        numBlocks = 0xff;
-                    else
-                        numBlocks = tmp;
-                }
-                if (!numBlocks)
-                    numBlocks = 0xff;
-                tmp = *(uint32_t *)(buf + 20 - 16);
-                if (tmp < MAX_BLOCKS) {
-                    uint8_t x = tmp;
-                    if ((writtenMask[x >> 3] & (1 << (x & 7))) == 0) {
-                        writtenMask[x >> 3] |= (1 << (x & 7));
-                        numBlocksWritten++;
-                    }
-                }
+        if (matched < 8) {
+            // FLASH.BIN - raw data for the flash at its offset in the file, bar the bootloader
+            // section at its end; a UF2 block is never taken for it, wherever the host puts it
+            if (FLASH_BIN_FILE && sector < APP_FLASH_SIZE / 512) {
+                if (programSector(sector * 512, matched, b))
+                    return true;
                 continue;
             }
 
-            if (numBlocks == 0) {
-                logChar('R');
-                targetReset();
-                _delay_ms(600); // so it stops blinking
-            }
+            // other file data - .Spotlight, System Volume Information and the like
+            if (discardBytes(512 - matched - 1))
+                return true;
+            continue;
+        }
 
-            if (!numPages)
-                continue;
+        // blocks not meant for the main flash
+        flags = Endpoint_Read_32_LE();
+        if (flags & UF2_FLAG_NOFLASH) {
+            if (discardBytes(512 - 12))
+                return true;
+            continue;
+        }
 
-            if (((bufno - 2) & (BLOCKS_PAR_PAGE - 1)) == 0) {
-                Serial_SendByte(STK_LOAD_ADDRESS);
-                Serial_SendByte(addr & 0xff); // little endian
-                Serial_SendByte(addr >> 8);
-                addr += SPM_PAGESIZE >> 1;
-                finishPacket();
-
-                Serial_SendByte(STK_PROG_PAGE);
-                Serial_SendByte(SPM_PAGESIZE >> 8); // and big endian here, go figure
-                Serial_SendByte(SPM_PAGESIZE & 0xff);
-                Serial_SendByte('F');
-            }
+        addr = Endpoint_Read_32_LE();
+
+        if (nextPacket())
+            return true;
+
+        tmp = Endpoint_Read_32_LE();
+        // the payload never reaches into the final magic number
+        payloadSize = tmp <= MAX_PAYLOAD - 4 ? tmp : 0;
+        uint32_t blockNo = Endpoint_Read_32_LE();
+        tmp = Endpoint_Read_32_LE();
+        uint32_t familyID = Endpoint_Read_32_LE(); // or the file size, without the flag
 
-            for (i = 0; i < MASS_STORAGE_IO_EPSIZE; ++i)
-                Serial_SendByte(buf[i]);
+        // part of a combined file for several boards - another board's blocks neither go to the
+        // target nor count towards completion, and are skipped as fast as the host sends them
+        if ((flags & UF2_FLAG_FAMILYID_PRESENT) && familyID != UF2_FAMILY_ID) {
+            Counters.ForeignBlocks++;
+            if (discardBytes(MAX_PAYLOAD))
+                return true;
+            continue;
+        }
+
+        beginSession();
 
-            if (((bufno - 2) & (BLOCKS_PAR_PAGE - 1)) == BLOCKS_PAR_PAGE - 1) {
-                finishPacket();
-                numPages--;
+        // a block count of its own, or block 0 coming round again once the file has been written
+        // up to its last block, means another file - the next one copied before the session went
+        // idle, or the next part of a concatenated one - whose blocks are tracked afresh, with the
+        // target staying in its bootloader; block 0 written again before that is the host
+        // rewriting a cluster of the same file, and stays a duplicate
+        if (!tmp || tmp > MAX_BLOCKS)
+            tmp = NUM_BLOCKS_UNKNOWN;
+        if (tmp != numBlocks || (!blockNo && lastBlockWritten))
+            beginFile(tmp);
+        if (blockNo < numBlocks) {
+            if (blockNo + 1 == numBlocks)
+                lastBlockWritten = true;
+            if (markBlock(blockNo)) {
+                numBlocksWritten++;
+            } else {
+                // already programmed in this session - the host wrote the same cluster again
+                Counters.DuplicateBlocks++;
+                payloadSize = 0;
             }
         }
 
-        /* Decrement the blocks remaining counter */
-        TotalBlocks--;
+        // EEPROM contents go through the same pages as the flash, still in the EEPROM window;
+        // payloads reaching past the application flash are dropped whole, as the bootloader
+        // can't write there and the STK500v1 page address would wrap round onto the sketch
+        if (!(TARGET_EEPROM_WRITES &&
+              inRegion(addr, payloadSize, EEPROM_BASE, TARGET_EEPROM_SIZE)) &&
+            !inRegion(addr, payloadSize, 0, APP_FLASH_SIZE))
+            payloadSize = 0;
+
+        if (programBytes(addr, payloadSize))
+            return true;
+
+        // padding after the payload
+        if (discardBytes(MAX_PAYLOAD - payloadSize))
+            return true;
     }
 
     /* If the endpoint is empty, clear it ready for the next packet from the host */
-    if (!(Endpoint_IsReadWriteAllowed()))
+    if (Endpoint_IsOUTReceived() && !(Endpoint_IsReadWriteAllowed()))
         Endpoint_ClearOUT();
-    
-    if (numBlocks && numBlocks != 0xff && numBlocksWritten >= numBlocks) {
-        numBlocksWritten = 0;
-        logChar('0'); 
-        // reboot target
-        //Serial_SendByte('Q');
-        //Serial_SendByte(CRC_EOP);
-        targetReset(); // we do a slow reboot of target, so we manage to reset ourselves before it wakes up
-        // don't wait for response
-        // and reboot ourselves soon
-        wdt_enable(WDTO_60MS);
+
+    bool done = numBlocks && numBlocks != NUM_BLOCKS_UNKNOWN && !untracked &&
+                numBlocksWritten >= numBlocks;
+
+    // the file may end mid-page
+    if (done)
+        flushPage();
+
+    // the write cache is reported as disabled, so the data has to be on the target before the
+    // command completes - except for a partial page, which waits for the block that fills it;
+    // outside a session, the last result is not ours
+    if (numBlocks && !waitForTarget())
+        failed = true;
+
+    if (failed) {
+        // get the target out of the bootloader, and start over on the next copy of the file
+        STK500_BeginStartApp();
+        waitForTarget();
+        resetSession();
+        return false;
     }
+
+    if (done) {
+        logChar('0');
+        Counters.CountCompletions++;
+        finishSession();
+    }
+
+    lastAccessTime = TIMER_NOW();
+    return true;
+}
+
+/** Closes the flashing session once the host has stopped writing to it for \c IDLE_COMMIT_MS, for
+ *  UF2 files whose blocks never add up - bogus block counts, blocks missing or written too far out
+ *  of order. Likewise lets the target out of its bootloader once the host has stopped reading
+ *  CURRENT.UF2 or FLASH.BIN, and tries the bootloader again on the next read after one failed.
+ *  Call this regularly from the main loop.
+ */
+void DataflashManager_Task(void) {
+    if ((uint16_t)(TIMER_NOW() - lastAccessTime) < TIMER_TICKS(IDLE_COMMIT_MS))
+        return;
+
+    if (numBlocks) {
+        logChar('I');
+        Counters.IdleCompletions++;
+        finishSession();
+    } else if (readback) {
+        if (readback == READBACK_ACTIVE) {
+            waitForTarget();
+            STK500_BeginStartApp();
+            waitForTarget();
+        }
+        readback = READBACK_NONE;
+    }
+}
+
+/** Checks whether the target is taken by a flashing session or a CURRENT.UF2 readback, which also
+ *  covers the time between the host's commands, or has a command sequence running.
+ *
+ *  \return Boolean \c true if the target must not be reset from elsewhere, \c false otherwise
+ */
+bool DataflashManager_IsBusy(void) {
+    return numBlocks || readback == READBACK_ACTIVE || STK500_IsBusy();
 }
 
 typedef struct {
@@ -243,7 +886,8 @@ const char infoUf2Name[] PROGMEM = "INFO_UF2TXT";
 const char infoUf2File[] PROGMEM = //
     "UF2 Bootloader " UF2_VERSION "\r\n"
     "Model: " PRODUCT_NAME "\r\n"
-    "Board-ID: " BOARD_ID "\r\n";
+    "Board-ID: " BOARD_ID "\r\n"
+    "Family-ID: " STRINGIFY_EXPANDED(UF2_FAMILY_ID) "\r\n";
 
 const char indexName[] PROGMEM = "INDEX   HTM";
 const char indexFile[] PROGMEM = //
@@ -268,18 +912,8 @@ static const char *getFileData(uint8_t idx, uint8_t tp) {
     }
 }
 
-#define NUM_INFO 2
-
-#define NUM_FAT_BLOCKS VIRTUAL_MEMORY_BLOCKS
-
-#define RESERVED_SECTORS 1
-#define ROOT_DIR_SECTORS 4
-#define SECTORS_PER_FAT ((NUM_FAT_BLOCKS * 2 + 511) / 512)
-
-#define START_FAT0 RESERVED_SECTORS
-#define START_FAT1 (START_FAT0 + SECTORS_PER_FAT)
-#define START_ROOTDIR (START_FAT1 + SECTORS_PER_FAT)
-#define START_CLUSTERS (START_ROOTDIR + ROOT_DIR_SECTORS)
+const char currentUf2Name[] PROGMEM = "CURRENT UF2";
+const char flashBinName[] PROGMEM = "FLASH   BIN";
 
 static const FAT_BootBlock BootBlock PROGMEM = {
     .JumpInstruction = {0xeb, 0x3c, 0x90},
@@ -313,6 +947,15 @@ static void write_from_pgm(const void *src, uint16_t count) {
 
 static void write_zeros(uint16_t count) { Endpoint_Null_Stream(count, NULL); }
 
+static void write_ones(uint16_t count) {
+    while (count--)
+        write_byte(0xff);
+}
+
+static void write_word(uint16_t w) { Endpoint_Write_Stream_LE(&w, 2, NULL); }
+
+static void write_dword(uint32_t w) { Endpoint_Write_Stream_LE(&w, 4, NULL); }
+
 static void padded_memcpy(char *dst, const char *src, int len) {
     for (int i = 0; i < len; ++i) {
         int ch = pgm_read_byte(src);
@@ -326,19 +969,103 @@ static void padded_memcpy(char *dst, const char *src, int len) {
     }
 }
 
+/** Gets a page of the target flash into the page buffer for CURRENT.UF2, unless it has been read
+ *  ahead already. The target is put in its bootloader for the first page, and again if it has
+ *  left it since, which stops the sketch until the host is done reading. Once the bootloader fails
+ *  to answer, no more pages are tried until then.
+ *
+ *  \param[in] addr  Byte address of the page
+ *
+ *  \return Boolean \c true if the page was read, \c false otherwise
+ */
+static bool readPage(uint32_t addr) {
+    if (readback == READBACK_FAILED)
+        return false;
+
+    if (readback == READBACK_ACTIVE && pageAddr == addr && waitForTarget())
+        return true;
+
+    for (uint8_t attempt = 0; attempt < 2; ++attempt) {
+        // a page read ahead that is not needed after all still has to finish
+        waitForTarget();
+
+        if (readback != READBACK_ACTIVE) {
+            STK500_BeginEnterBootloader();
+            if (!waitForTarget())
+                break;
+            readback = READBACK_ACTIVE;
+        }
+
+        pageAddr = addr;
+        STK500_BeginReadPage(STK_MEMTYPE_FLASH, addr, pageBuffer, TARGET_CHUNKSIZE);
+        if (waitForTarget())
+            return true;
+
+        // the bootloader may have timed out since the last read
+        readback = READBACK_NONE;
+    }
+
+    readback = READBACK_FAILED;
+    return false;
+}
+
+/** Writes \p count bytes of the target flash from \p addr on to the endpoint, reading them from the
+ *  target as it goes. Each next page is read ahead over the UART while the data before it goes out
+ *  over USB. Pages that can't be read come out erased.
+ *
+ *  \param[in] addr   Byte address of the first page
+ *  \param[in] count  Number of bytes, a whole number of pages
+ */
+static void write_from_target(uint32_t addr, uint16_t count) {
+    for (uint8_t i = 0; i < count / TARGET_CHUNKSIZE; ++i) {
+        // a write session has the page buffer, and the target, to itself
+        bool ok = !numBlocks && readPage(addr);
+
+        Endpoint_SelectEndpoint(MASS_STORAGE_IN_EPADDR);
+        if (ok)
+            write_from_data(pageBuffer, TARGET_CHUNKSIZE);
+        else
+            write_ones(TARGET_CHUNKSIZE);
+
+        addr += TARGET_CHUNKSIZE;
+        if (ok && addr < TARGET_FLASH_SIZE) {
+            pageAddr = addr;
+            STK500_BeginReadPage(STK_MEMTYPE_FLASH, addr, pageBuffer, TARGET_CHUNKSIZE);
+        }
+    }
+}
+
+/** Writes block \p blockNo of CURRENT.UF2 to the endpoint, with the payload read from the target
+ *  flash as it goes.
+ *
+ *  \param[in] blockNo  UF2 block number, which is also the cluster number within the file
+ */
+static void writeCurrentUF2Block(uint16_t blockNo) {
+    uint32_t addr = (uint32_t)blockNo * CURRENT_UF2_PAYLOAD;
+
+    // field by field, rather than from a copy of the header on this already deep stack
+    write_from_pgm(uf2magic, 8);
+    write_dword(UF2_FLAG_FAMILYID_PRESENT);
+    write_dword(addr);
+    write_dword(CURRENT_UF2_PAYLOAD);
+    write_dword(blockNo);
+    write_dword(CURRENT_UF2_BLOCKS);
+    write_dword(UF2_FAMILY_ID);
+    write_from_target(addr, CURRENT_UF2_PAYLOAD);
+    write_zeros(MAX_PAYLOAD - CURRENT_UF2_PAYLOAD - 4);
+    write_dword(UF2_MAGIC_END);
+}
+
 /** Reads blocks (OS blocks, not Dataflash pages) from the storage medium, the board Dataflash
  * IC(s), into
  *  the pre-selected data IN endpoint. This routine reads in Dataflash page sized blocks from the
  * Dataflash
  *  and writes them in OS sized blocks to the endpoint.
  *
- *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration
- * and state
  *  \param[in] BlockAddress  Data block starting address for the read sequence
  *  \param[in] TotalBlocks   Number of blocks of data to read
  */
-void DataflashManager_ReadBlocks(USB_ClassInfo_MS_Device_t *const MSInterfaceInfo,
-                                 uint32_t block_no, uint16_t TotalBlocks) {
+void DataflashManager_ReadBlocks(uint32_t block_no, uint16_t TotalBlocks) {
 
     uint16_t i, sectionIdx;
 
@@ -371,13 +1098,22 @@ void DataflashManager_ReadBlocks(USB_ClassInfo_MS_Device_t *const MSInterfaceInf
             // logval("sidx", sectionIdx);
             if (sectionIdx >= SECTORS_PER_FAT)
                 sectionIdx -= SECTORS_PER_FAT;
-            i = 0;
-            if (sectionIdx == 0) {
-                write_byte(0xf0);
-                for (i = 1; i < 4 + NUM_INFO * 2; ++i)
-                    write_byte(0xff);
+            // the info files are a cluster each, CURRENT.UF2 and FLASH.BIN chains of clusters after
+            // them
+            for (i = 0; i < 256; ++i) {
+                uint16_t cluster = sectionIdx * 256 + i;
+
+                if (cluster >= CLUSTERS_END)
+                    break;
+                if (cluster == 0)
+                    write_word(0xfff0);
+                else if (cluster < CURRENT_UF2_CLUSTER || cluster == CURRENT_UF2_END - 1 ||
+                         cluster == FLASH_BIN_END - 1)
+                    write_word(0xffff);
+                else
+                    write_word(cluster + 1);
             }
-            write_zeros(512 - i);
+            write_zeros(512 - i * 2);
         } else if (block_no < START_CLUSTERS) {
             sectionIdx -= START_ROOTDIR;
             if (sectionIdx == 0) {
@@ -393,7 +1129,21 @@ void DataflashManager_ReadBlocks(USB_ClassInfo_MS_Device_t *const MSInterfaceInf
                     padded_memcpy(d.name, getFileData(i, 0), 11);
                     write_from_data(&d, sizeof(d));
                 }
-                write_zeros(512 - (NUM_INFO + 1) * 32);
+                if (CURRENT_UF2_FILE) {
+                    memset(&d, 0, sizeof(d));
+                    d.size = CURRENT_UF2_BLOCKS * 512UL;
+                    d.startCluster = CURRENT_UF2_CLUSTER;
+                    padded_memcpy(d.name, currentUf2Name, 11);
+                    write_from_data(&d, sizeof(d));
+                }
+                if (FLASH_BIN_FILE) {
+                    memset(&d, 0, sizeof(d));
+                    d.size = TARGET_FLASH_SIZE;
+                    d.startCluster = FLASH_BIN_CLUSTER;
+                    padded_memcpy(d.name, flashBinName, 11);
+                    write_from_data(&d, sizeof(d));
+                }
+                write_zeros(512 - (NUM_INFO + 1 + CURRENT_UF2_FILE + FLASH_BIN_FILE) * 32);
             } else {
                 write_zeros(512);
             }
@@ -403,13 +1153,17 @@ void DataflashManager_ReadBlocks(USB_ClassInfo_MS_Device_t *const MSInterfaceInf
                 i = strlen_P(getFileData(sectionIdx, 1));
                 write_from_pgm(getFileData(sectionIdx, 1), i);
                 write_zeros(512 - i);
+            } else if (sectionIdx < CURRENT_UF2_END - 2) {
+                writeCurrentUF2Block(sectionIdx - NUM_INFO);
+            } else if (sectionIdx < CLUSTERS_END - 2) {
+                write_from_target((uint32_t)(sectionIdx - (FLASH_BIN_CLUSTER - 2)) * 512, 512);
             } else {
                 write_zeros(512);
             }
         }
 
         /* Check if the current command is being aborted by the host */
-        if (MSInterfaceInfo->State.IsMassStoreReset)
+        if (IsMassStoreReset)
             return;
 
         /* Decrement the blocks remaining counter */
@@ -420,4 +1174,9 @@ void DataflashManager_ReadBlocks(USB_ClassInfo_MS_Device_t *const MSInterfaceInf
     /* If the endpoint is full, send its contents to the host */
     if (!(Endpoint_IsReadWriteAllowed()))
         Endpoint_ClearIN();
+
+    // a host that keeps polling the disk would otherwise hold a flashing session open for good;
+    // reads only keep a CURRENT.UF2 readback going
+    if (!numBlocks)
+        lastAccessTime = TIMER_NOW();
 }
@@ -41,6 +41,7 @@
 
 		#include "../uf2uno.h"
 		#include "../Descriptors.h"
+		#include "STK500.h"
 		#include "Config/AppConfig.h"
 
 		#include <LUFA/Common/Common.h>
@@ -62,12 +63,14 @@
 		#define LUN_MEDIA_BLOCKS         (VIRTUAL_MEMORY_BLOCKS / TOTAL_LUNS)
 
 	/* Function Prototypes: */
-		void DataflashManager_WriteBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
-		                                  const uint32_t BlockAddress,
+		bool DataflashManager_WriteBlocks(const uint32_t BlockAddress,
 		                                  uint16_t TotalBlocks);
-		void DataflashManager_ReadBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
-		                                 const uint32_t BlockAddress,
+		void DataflashManager_ReadBlocks(const uint32_t BlockAddress,
 		                                 uint16_t TotalBlocks);
+		bool DataflashManager_CheckMediaChanged(void);
+		void DataflashManager_Task(void);
+		bool DataflashManager_IsBusy(void);
+		void DataflashManager_InvalidateCrcMap(void);
 
 #endif
 
@@ -0,0 +1,180 @@
+/** \file
+ *
+ *  Bulk-Only Transport engine for the single LUN virtual disk, in place of the generic LUFA Mass Storage
+ *  class driver. The Command Block Wrapper is read in place and answered in place: the Command Status
+ *  Wrapper shares its signature, tag and length fields, so the status is built over the command it answers.
+ */
+
+#define  INCLUDE_FROM_MASSSTORAGE_C
+#include "MassStorage.h"
+
+/** Command Block Wrapper of the command being processed, turned into its Command Status Wrapper once done. */
+MS_CommandBlockWrapper_t CommandBlock;
+
+/** Flag set by the Mass Storage Reset request, to abort the command in progress. */
+volatile bool IsMassStoreReset;
+
+/** Flag set while the Command Status Wrapper of the last command is waiting for the host to clear a stalled
+ *  data endpoint, so that the main loop keeps running in the meantime.
+ */
+static bool IsStatusPending;
+
+/** Configures the Mass Storage data endpoints, once the host has selected the device configuration.
+ *
+ *  \return Boolean \c true if the endpoints were configured successfully, \c false otherwise
+ */
+bool MassStorage_ConfigureEndpoints(void)
+{
+	IsMassStoreReset = false;
+	IsStatusPending  = false;
+
+	return Endpoint_ConfigureEndpoint(MASS_STORAGE_IN_EPADDR, EP_TYPE_BULK, MASS_STORAGE_IO_EPSIZE, MASS_STORAGE_IO_EPBANKS) &&
+	       Endpoint_ConfigureEndpoint(MASS_STORAGE_OUT_EPADDR, EP_TYPE_BULK, MASS_STORAGE_IO_EPSIZE, MASS_STORAGE_IO_EPBANKS);
+}
+
+/** Handles the Mass Storage class specific control requests. Called from the library USB Control Request
+ *  reception event.
+ */
+void MassStorage_ProcessControlRequest(void)
+{
+	if (USB_ControlRequest.wIndex != INTERFACE_ID_MassStorage)
+	  return;
+
+	switch (USB_ControlRequest.bRequest)
+	{
+		case MS_REQ_MassStorageReset:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE))
+			{
+				Endpoint_ClearSETUP();
+				Endpoint_ClearStatusStage();
+
+				/* Abort the command in progress, the endpoints are reset by the next Mass Storage task */
+				IsMassStoreReset = true;
+			}
+
+			break;
+		case MS_REQ_GetMaxLUN:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE))
+			{
+				Endpoint_ClearSETUP();
+				while (!(Endpoint_IsINReady()));
+				Endpoint_Write_8(TOTAL_LUNS - 1);
+				Endpoint_ClearIN();
+				Endpoint_ClearStatusStage();
+			}
+
+			break;
+	}
+}
+
+/** Processes the next command from the host, if one has arrived: reads in its Command Block Wrapper, runs the
+ *  SCSI command and returns its status.
+ */
+void MassStorage_Task(void)
+{
+	if (USB_DeviceState != DEVICE_STATE_Configured)
+	  return;
+
+	if (IsMassStoreReset)
+	  MassStorage_ResetDataEndpoints();
+
+	if (!(IsStatusPending))
+	{
+		Endpoint_SelectEndpoint(MASS_STORAGE_OUT_EPADDR);
+
+		if (!(Endpoint_IsOUTReceived()) || !(MassStorage_ReadInCommandBlock()))
+		  return;
+
+		/* Data is sent from the IN endpoint and received on the OUT endpoint */
+		if (CommandBlock.Flags & MS_COMMAND_DIR_DATA_IN)
+		  Endpoint_SelectEndpoint(MASS_STORAGE_IN_EPADDR);
+
+		LEDs_TurnOnLEDs(LEDMASK_MSD);
+		bool CommandSuccess = SCSI_DecodeSCSICommand();
+		LEDs_TurnOffLEDs(LEDMASK_MSD);
+
+		if (IsMassStoreReset)
+		{
+			MassStorage_ResetDataEndpoints();
+			return;
+		}
+
+		/* The status wrapper overlays the command wrapper - the tag stays, and the residue is whatever length
+		 * the command handler did not transfer */
+		MS_CommandStatusWrapper_t* CommandStatus = (MS_CommandStatusWrapper_t*)&CommandBlock;
+		CommandStatus->Signature = CPU_TO_LE32(MS_CSW_SIGNATURE);
+		CommandStatus->Status    = CommandSuccess ? MS_SCSI_COMMAND_Pass : MS_SCSI_COMMAND_Fail;
+
+		/* Stall the data endpoint if the host expected more data than was transferred */
+		if (!(CommandSuccess) && CommandStatus->DataTransferResidue)
+		  Endpoint_StallTransaction();
+
+		IsStatusPending = true;
+	}
+
+	MassStorage_ReturnCommandStatus();
+}
+
+/** Reads in the Command Block Wrapper from the host, and checks that it is valid and meaningful for this device.
+ *  An invalid wrapper stalls both data endpoints, until the host recovers with a Mass Storage Reset.
+ *
+ *  \return Boolean \c true if a valid command was read, \c false otherwise
+ */
+static bool MassStorage_ReadInCommandBlock(void)
+{
+	if (Endpoint_Read_Stream_LE(&CommandBlock, sizeof(CommandBlock), NULL) != ENDPOINT_RWSTREAM_NoError)
+	  return false;
+
+	Endpoint_ClearOUT();
+
+	if ((CommandBlock.Signature         != CPU_TO_LE32(MS_CBW_SIGNATURE)) ||
+	    (CommandBlock.LUN               != 0) ||
+	    (CommandBlock.Flags             & 0x1F) ||
+	    (CommandBlock.SCSICommandLength == 0) ||
+	    (CommandBlock.SCSICommandLength >  sizeof(CommandBlock.SCSICommandData)))
+	{
+		Endpoint_StallTransaction();
+		Endpoint_SelectEndpoint(MASS_STORAGE_IN_EPADDR);
+		Endpoint_StallTransaction();
+
+		return false;
+	}
+
+	return true;
+}
+
+/** Sends the pending Command Status Wrapper to the host, once the host has cleared any stall on the data
+ *  endpoints. Until then the status stays pending, and the task tries again on its next run.
+ */
+static void MassStorage_ReturnCommandStatus(void)
+{
+	Endpoint_SelectEndpoint(MASS_STORAGE_OUT_EPADDR);
+	if (Endpoint_IsStalled())
+	  return;
+
+	Endpoint_SelectEndpoint(MASS_STORAGE_IN_EPADDR);
+	if (Endpoint_IsStalled() || !(Endpoint_IsINReady()))
+	  return;
+
+	Endpoint_Write_Stream_LE(&CommandBlock, sizeof(MS_CommandStatusWrapper_t), NULL);
+	Endpoint_ClearIN();
+
+	IsStatusPending = false;
+}
+
+/** Completes a Mass Storage Reset, dropping any half transferred command and clearing the data endpoints. */
+static void MassStorage_ResetDataEndpoints(void)
+{
+	Endpoint_ResetEndpoint(MASS_STORAGE_OUT_EPADDR);
+	Endpoint_ResetEndpoint(MASS_STORAGE_IN_EPADDR);
+
+	Endpoint_SelectEndpoint(MASS_STORAGE_OUT_EPADDR);
+	Endpoint_ClearStall();
+	Endpoint_ResetDataToggle();
+	Endpoint_SelectEndpoint(MASS_STORAGE_IN_EPADDR);
+	Endpoint_ClearStall();
+	Endpoint_ResetDataToggle();
+
+	IsMassStoreReset = false;
+	IsStatusPending  = false;
+}
@@ -0,0 +1,39 @@
+/** \file
+ *
+ *  Header file for MassStorage.c.
+ */
+
+#ifndef _MASS_STORAGE_H_
+#define _MASS_STORAGE_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+
+		#include <LUFA/Drivers/USB/USB.h>
+
+		#include "../uf2uno.h"
+		#include "../Descriptors.h"
+		#include "SCSI.h"
+		#include "Config/AppConfig.h"
+
+	/* Macros: */
+		#if (TOTAL_LUNS != 1)
+			#error The Bulk-Only Transport engine only serves a single LUN.
+		#endif
+
+	/* Global Variables: */
+		extern MS_CommandBlockWrapper_t CommandBlock;
+		extern volatile bool            IsMassStoreReset;
+
+	/* Function Prototypes: */
+		bool MassStorage_ConfigureEndpoints(void);
+		void MassStorage_ProcessControlRequest(void);
+		void MassStorage_Task(void);
+
+		#if defined(INCLUDE_FROM_MASSSTORAGE_C)
+			static bool MassStorage_ReadInCommandBlock(void);
+			static void MassStorage_ReturnCommandStatus(void);
+			static void MassStorage_ResetDataEndpoints(void);
+		#endif
+
+#endif
@@ -39,9 +39,9 @@
 #include "SCSI.h"
 
 /** Structure to hold the SCSI response data to a SCSI INQUIRY command. This gives information about the device's
- *  features and capabilities.
+ *  features and capabilities. It never changes, so it is kept in flash rather than taking up RAM.
  */
-static const SCSI_Inquiry_Response_t InquiryData =
+static const SCSI_Inquiry_Response_t InquiryData PROGMEM =
 	{
 		.DeviceType          = DEVICE_TYPE_BLOCK,
 		.PeripheralQualifier = 0,
@@ -70,6 +70,25 @@ static const SCSI_Inquiry_Response_t InquiryData =
 		.RevisionID          = {'0','.','0','0'},
 	};
 
+/** Mode pages returned by the SCSI MODE SENSE commands, each stored as its page code, page length and parameters.
+ *  Only current values are reported, and none of them can be changed by the host.
+ */
+static const uint8_t ModePages[] PROGMEM =
+	{
+		/* Read-Write Error Recovery page, no retries or recovery reported */
+		MODE_PAGE_RW_ERROR_RECOVERY, 0x0A,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+
+		/* Caching page, with the write cache disabled (WCE clear) and the read cache enabled (RCD clear) */
+		MODE_PAGE_CACHING, 0x12,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+
+		/* Informational Exceptions Control page, no exception reporting */
+		MODE_PAGE_INFORMATIONAL_EXCEPTIONS, 0x0A,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	};
+
 /** Structure to hold the sense data for the last issued SCSI command, which is returned to the host after a SCSI REQUEST SENSE
  *  command is issued. This gives information on exactly why the last command failed to complete.
  */
@@ -80,58 +99,70 @@ static SCSI_Request_Sense_Response_t SenseData =
 	};
 
 
+/** Dispatch table of the supported SCSI commands, searched by \ref SCSI_DecodeSCSICommand() for the handler of each
+ *  issued command. Commands with neither data nor side effects share \ref SCSI_Command_No_Data().
+ */
+static const SCSI_CommandTableEntry_t CommandTable[] PROGMEM =
+	{
+		{SCSI_CMD_READ_10,                        SCSI_Command_ReadWrite_10},
+		{SCSI_CMD_WRITE_10,                       SCSI_Command_ReadWrite_10},
+		{SCSI_CMD_TEST_UNIT_READY,                SCSI_Command_No_Data},
+		{SCSI_CMD_REQUEST_SENSE,                  SCSI_Command_Request_Sense},
+		{SCSI_CMD_INQUIRY,                        SCSI_Command_Inquiry},
+		{SCSI_CMD_READ_CAPACITY_10,               SCSI_Command_Read_Capacity_10},
+		{SCSI_CMD_SERVICE_ACTION_IN_16,           SCSI_Command_Read_Capacity_16},
+		{SCSI_CMD_READ_FORMAT_CAPACITIES,         SCSI_Command_Read_Format_Capacities},
+		{SCSI_CMD_MODE_SENSE_6,                   SCSI_Command_ModeSense},
+		{SCSI_CMD_MODE_SENSE_10,                  SCSI_Command_ModeSense},
+		{SCSI_CMD_SEND_DIAGNOSTIC,                SCSI_Command_Send_Diagnostic},
+		/* Writes are passed on to the target as they arrive, so there is never anything cached to flush */
+		{SCSI_CMD_SYNCHRONIZE_CACHE_10,           SCSI_Command_No_Data},
+		{SCSI_CMD_SYNCHRONIZE_CACHE_16,           SCSI_Command_No_Data},
+		{SCSI_CMD_START_STOP_UNIT,                SCSI_Command_No_Data},
+		{SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL,   SCSI_Command_No_Data},
+		{SCSI_CMD_VERIFY_10,                      SCSI_Command_No_Data},
+	};
+
 /** Main routine to process the SCSI command located in the Command Block Wrapper read from the host. This dispatches
  *  to the appropriate SCSI command handling routine if the issued command is supported by the device, else it returns
  *  a command failure due to a ILLEGAL REQUEST.
  *
- *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
- *
  *  \return Boolean \c true if the command completed successfully, \c false otherwise
  */
-bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+bool SCSI_DecodeSCSICommand(void)
 {
 	bool CommandSuccess = false;
+	uint8_t Command     = CommandBlock.SCSICommandData[0];
+
+	/* After a completed flash the disk contents are reset, so report a medium change to make the host
+	 * drop its cached file system - INQUIRY and REQUEST SENSE must not consume the UNIT ATTENTION */
+	if ((Command != SCSI_CMD_INQUIRY) && (Command != SCSI_CMD_REQUEST_SENSE) && DataflashManager_CheckMediaChanged())
+	{
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_UNIT_ATTENTION,
+		               SCSI_ASENSE_NOT_READY_TO_READY_CHANGE,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
 
-	/* Run the appropriate SCSI command hander function based on the passed command */
-	switch (MSInterfaceInfo->State.CommandBlock.SCSICommandData[0])
+	/* Look up the handler for the issued command in the dispatch table */
+	const SCSI_CommandTableEntry_t* Entry = CommandTable;
+	while (pgm_read_byte(&Entry->Command) != Command)
 	{
-		case SCSI_CMD_INQUIRY:
-			CommandSuccess = SCSI_Command_Inquiry(MSInterfaceInfo);
-			break;
-		case SCSI_CMD_REQUEST_SENSE:
-			CommandSuccess = SCSI_Command_Request_Sense(MSInterfaceInfo);
-			break;
-		case SCSI_CMD_READ_CAPACITY_10:
-			CommandSuccess = SCSI_Command_Read_Capacity_10(MSInterfaceInfo);
-			break;
-		case SCSI_CMD_SEND_DIAGNOSTIC:
-			CommandSuccess = SCSI_Command_Send_Diagnostic(MSInterfaceInfo);
-			break;
-		case SCSI_CMD_WRITE_10:
-			CommandSuccess = SCSI_Command_ReadWrite_10(MSInterfaceInfo, DATA_WRITE);
-			break;
-		case SCSI_CMD_READ_10:
-			CommandSuccess = SCSI_Command_ReadWrite_10(MSInterfaceInfo, DATA_READ);
-			break;
-		case SCSI_CMD_MODE_SENSE_6:
-			CommandSuccess = SCSI_Command_ModeSense_6(MSInterfaceInfo);
-			break;
-		case SCSI_CMD_START_STOP_UNIT:
-		case SCSI_CMD_TEST_UNIT_READY:
-		case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
-		case SCSI_CMD_VERIFY_10:
-			/* These commands should just succeed, no handling required */
-			CommandSuccess = true;
-			MSInterfaceInfo->State.CommandBlock.DataTransferLength = 0;
-			break;
-		default:
+		if (++Entry == &CommandTable[sizeof(CommandTable) / sizeof(CommandTable[0])])
+		{
 			/* Update the SENSE key to reflect the invalid command */
 			SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
-		                   SCSI_ASENSE_INVALID_COMMAND,
-		                   SCSI_ASENSEQ_NO_QUALIFIER);
-			break;
+			               SCSI_ASENSE_INVALID_COMMAND,
+			               SCSI_ASENSEQ_NO_QUALIFIER);
+
+			return false;
+		}
 	}
 
+	/* Run the handler of the command */
+	CommandSuccess = ((SCSI_CommandHandler_t)pgm_read_word(&Entry->Handler))();
+
 	/* Check if command was successfully processed */
 	if (CommandSuccess)
 	{
@@ -148,18 +179,16 @@ bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 /** Command processing for an issued SCSI INQUIRY command. This command returns information about the device's features
  *  and capabilities to the host.
  *
- *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
- *
  *  \return Boolean \c true if the command completed successfully, \c false otherwise.
  */
-static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+static bool SCSI_Command_Inquiry(void)
 {
-	uint16_t AllocationLength  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[3]);
+	uint16_t AllocationLength  = SwapEndian_16(*(uint16_t*)&CommandBlock.SCSICommandData[3]);
 	uint16_t BytesTransferred  = MIN(AllocationLength, sizeof(InquiryData));
 
 	/* Only the standard INQUIRY data is supported, check if any optional INQUIRY bits set */
-	if ((MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & ((1 << 0) | (1 << 1))) ||
-	     MSInterfaceInfo->State.CommandBlock.SCSICommandData[2])
+	if ((CommandBlock.SCSICommandData[1] & ((1 << 0) | (1 << 1))) ||
+	     CommandBlock.SCSICommandData[2])
 	{
 		/* Optional but unsupported bits set - update the SENSE key and fail the request */
 		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
@@ -169,7 +198,7 @@ static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInf
 		return false;
 	}
 
-	Endpoint_Write_Stream_LE(&InquiryData, BytesTransferred, NULL);
+	Endpoint_Write_PStream_LE(&InquiryData, BytesTransferred, NULL);
 
 	/* Pad out remaining bytes with 0x00 */
 	Endpoint_Null_Stream((AllocationLength - BytesTransferred), NULL);
@@ -178,7 +207,7 @@ static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInf
 	Endpoint_ClearIN();
 
 	/* Succeed the command and update the bytes transferred counter */
-	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+	CommandBlock.DataTransferLength -= BytesTransferred;
 
 	return true;
 }
@@ -186,13 +215,11 @@ static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInf
 /** Command processing for an issued SCSI REQUEST SENSE command. This command returns information about the last issued command,
  *  including the error code and additional error information so that the host can determine why a command failed to complete.
  *
- *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
- *
  *  \return Boolean \c true if the command completed successfully, \c false otherwise.
  */
-static bool SCSI_Command_Request_Sense(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+static bool SCSI_Command_Request_Sense(void)
 {
-	uint8_t  AllocationLength = MSInterfaceInfo->State.CommandBlock.SCSICommandData[4];
+	uint8_t  AllocationLength = CommandBlock.SCSICommandData[4];
 	uint8_t  BytesTransferred = MIN(AllocationLength, sizeof(SenseData));
 
 	Endpoint_Write_Stream_LE(&SenseData, BytesTransferred, NULL);
@@ -200,7 +227,7 @@ static bool SCSI_Command_Request_Sense(USB_ClassInfo_MS_Device_t* const MSInterf
 	Endpoint_ClearIN();
 
 	/* Succeed the command and update the bytes transferred counter */
-	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+	CommandBlock.DataTransferLength -= BytesTransferred;
 
 	return true;
 }
@@ -208,11 +235,9 @@ static bool SCSI_Command_Request_Sense(USB_ClassInfo_MS_Device_t* const MSInterf
 /** Command processing for an issued SCSI READ CAPACITY (10) command. This command returns information about the device's capacity
  *  on the selected Logical Unit (drive), as a number of OS-sized blocks.
  *
- *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
- *
  *  \return Boolean \c true if the command completed successfully, \c false otherwise.
  */
-static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+static bool SCSI_Command_Read_Capacity_10(void)
 {
 	uint32_t LastBlockAddressInLUN = (LUN_MEDIA_BLOCKS - 1);
 	uint32_t MediaBlockSize        = VIRTUAL_MEMORY_BLOCK_SIZE;
@@ -222,7 +247,77 @@ static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInt
 	Endpoint_ClearIN();
 
 	/* Succeed the command and update the bytes transferred counter */
-	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= 8;
+	CommandBlock.DataTransferLength -= 8;
+
+	return true;
+}
+
+/** Command processing for an issued SCSI READ CAPACITY (16) command, sent as the READ CAPACITY service action of
+ *  SERVICE ACTION IN (16). Hosts that issue it at attach otherwise retry with the 10 byte variant after a failure,
+ *  so it is answered with the same capacity information in the longer format.
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Read_Capacity_16(void)
+{
+	uint32_t AllocationLength = SwapEndian_32(*(uint32_t*)&CommandBlock.SCSICommandData[10]);
+	uint8_t  BytesTransferred = MIN(AllocationLength, 32);
+	uint8_t  CapacityData[12] =
+		{
+			/* 64-bit last block address, of which only the lower half is ever used */
+			0x00, 0x00, 0x00, 0x00,
+			(uint8_t)((LUN_MEDIA_BLOCKS - 1) >> 24), (uint8_t)((LUN_MEDIA_BLOCKS - 1) >> 16),
+			(uint8_t)((LUN_MEDIA_BLOCKS - 1) >> 8), (uint8_t)(LUN_MEDIA_BLOCKS - 1),
+			0x00, 0x00, (uint8_t)(VIRTUAL_MEMORY_BLOCK_SIZE >> 8), (uint8_t)VIRTUAL_MEMORY_BLOCK_SIZE,
+		};
+
+	/* Only the READ CAPACITY service action is supported */
+	if ((CommandBlock.SCSICommandData[1] & 0x1F) != SCSI_SA_READ_CAPACITY_16)
+	{
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* Remaining protection and provisioning fields are all zero */
+	Endpoint_Write_Stream_LE(CapacityData, MIN(BytesTransferred, sizeof(CapacityData)), NULL);
+	if (BytesTransferred > sizeof(CapacityData))
+	  Endpoint_Null_Stream(BytesTransferred - sizeof(CapacityData), NULL);
+
+	Endpoint_ClearIN();
+
+	/* Succeed the command and update the bytes transferred counter */
+	CommandBlock.DataTransferLength -= BytesTransferred;
+
+	return true;
+}
+
+/** Command processing for an issued SCSI READ FORMAT CAPACITIES command. Windows issues this command when a drive is
+ *  attached, and delays mounting while it retries on failure. The response is a capacity list holding a single
+ *  descriptor for the current (formatted) medium.
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Read_Format_Capacities(void)
+{
+	uint16_t AllocationLength = SwapEndian_16(*(uint16_t*)&CommandBlock.SCSICommandData[7]);
+	uint8_t  CapacityList[12] =
+		{
+			0x00, 0x00, 0x00, 0x08, /* Capacity list header, one 8-byte descriptor follows */
+			(uint8_t)(LUN_MEDIA_BLOCKS >> 24), (uint8_t)(LUN_MEDIA_BLOCKS >> 16),
+			(uint8_t)(LUN_MEDIA_BLOCKS >> 8), (uint8_t)LUN_MEDIA_BLOCKS,
+			0x02, /* Formatted media, current capacity */
+			0x00, (uint8_t)(VIRTUAL_MEMORY_BLOCK_SIZE >> 8), (uint8_t)VIRTUAL_MEMORY_BLOCK_SIZE,
+		};
+	uint8_t  BytesTransferred = MIN(AllocationLength, sizeof(CapacityList));
+
+	Endpoint_Write_Stream_LE(CapacityList, BytesTransferred, NULL);
+	Endpoint_ClearIN();
+
+	/* Succeed the command and update the bytes transferred counter */
+	CommandBlock.DataTransferLength -= BytesTransferred;
 
 	return true;
 }
@@ -231,14 +326,12 @@ static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInt
  *  board, and indicates if they are present and functioning correctly. Only the Self-Test portion of the diagnostic command is
  *  supported.
  *
- *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
- *
  *  \return Boolean \c true if the command completed successfully, \c false otherwise.
  */
-static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+static bool SCSI_Command_Send_Diagnostic(void)
 {
 	/* Check to see if the SELF TEST bit is not set */
-	if (!(MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & (1 << 2)))
+	if (!(CommandBlock.SCSICommandData[1] & (1 << 2)))
 	{
 		/* Only self-test supported - update SENSE key and fail the command */
 		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
@@ -249,7 +342,19 @@ static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInte
 	}
 
 	/* Succeed the command and update the bytes transferred counter */
-	MSInterfaceInfo->State.CommandBlock.DataTransferLength = 0;
+	CommandBlock.DataTransferLength = 0;
+
+	return true;
+}
+
+/** Command processing for the SCSI commands that should just succeed, as there is nothing to transfer and no
+ *  handling required.
+ *
+ *  \return Boolean \c true, as the command always completes successfully.
+ */
+static bool SCSI_Command_No_Data(void)
+{
+	CommandBlock.DataTransferLength = 0;
 
 	return true;
 }
@@ -258,14 +363,11 @@ static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInte
  *  and total number of blocks to process, then calls the appropriate low-level Dataflash routine to handle the actual
  *  reading and writing of the data.
  *
- *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
- *  \param[in] IsDataRead  Indicates if the command is a READ (10) command or WRITE (10) command (DATA_READ or DATA_WRITE)
- *
  *  \return Boolean \c true if the command completed successfully, \c false otherwise.
  */
-static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
-                                      const bool IsDataRead)
+static bool SCSI_Command_ReadWrite_10(void)
 {
+	const bool IsDataRead = (CommandBlock.SCSICommandData[0] == SCSI_CMD_READ_10);
 	uint32_t BlockAddress;
 	uint16_t TotalBlocks;
 
@@ -281,10 +383,10 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
 	}
 
 	/* Load in the 32-bit block address (SCSI uses big-endian, so have to reverse the byte order) */
-	BlockAddress = SwapEndian_32(*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[2]);
+	BlockAddress = SwapEndian_32(*(uint32_t*)&CommandBlock.SCSICommandData[2]);
 
 	/* Load in the 16-bit total blocks (SCSI uses big-endian, so have to reverse the byte order) */
-	TotalBlocks  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+	TotalBlocks  = SwapEndian_16(*(uint16_t*)&CommandBlock.SCSICommandData[7]);
 
 	/* Check if the block address is outside the maximum allowable value for the LUN */
 	if (BlockAddress >= LUN_MEDIA_BLOCKS)
@@ -299,40 +401,125 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
 
 	#if (TOTAL_LUNS > 1)
 	/* Adjust the given block address to the real media address based on the selected LUN */
-	BlockAddress += ((uint32_t)MSInterfaceInfo->State.CommandBlock.LUN * LUN_MEDIA_BLOCKS);
+	BlockAddress += ((uint32_t)CommandBlock.LUN * LUN_MEDIA_BLOCKS);
 	#endif
 
 	/* Determine if the packet is a READ (10) or WRITE (10) command, call appropriate function */
+	bool Success = true;
 	if (IsDataRead == DATA_READ)
-	  DataflashManager_ReadBlocks(MSInterfaceInfo, BlockAddress, TotalBlocks);
+	  DataflashManager_ReadBlocks(BlockAddress, TotalBlocks);
 	else
-	  DataflashManager_WriteBlocks(MSInterfaceInfo, BlockAddress, TotalBlocks);
+	  Success = DataflashManager_WriteBlocks(BlockAddress, TotalBlocks);
 
-	/* Update the bytes transferred counter and succeed the command */
-	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ((uint32_t)TotalBlocks * VIRTUAL_MEMORY_BLOCK_SIZE);
+	/* Update the bytes transferred counter - all data is consumed even if the target could not be programmed */
+	CommandBlock.DataTransferLength -= ((uint32_t)TotalBlocks * VIRTUAL_MEMORY_BLOCK_SIZE);
 
-	return true;
+	if (!Success && STK500_VerifyFailed())
+	{
+		/* Target kept reading back different data, update the SENSE key and fail the command */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_MISCOMPARE,
+		               SCSI_ASENSE_MISCOMPARE_DURING_VERIFY,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+	}
+	else if (!Success)
+	{
+		/* Target did not take the data, update the SENSE key and fail the command */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+		               SCSI_ASENSE_WRITE_ERROR,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+	}
+
+	return Success;
 }
 
-/** Command processing for an issued SCSI MODE SENSE (6) command. This command returns various informational pages about
- *  the SCSI device, as well as the device's Write Protect status.
- *
- *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+/** Command processing for an issued SCSI MODE SENSE (6) or MODE SENSE (10) command. This command returns various
+ *  informational pages about the SCSI device, as well as the device's Write Protect status. The Caching page reports
+ *  the write cache as disabled, so that hosts do not hold back UF2 writes expecting the device to cache them anyway.
  *
  *  \return Boolean \c true if the command completed successfully, \c false otherwise.
  */
-static bool SCSI_Command_ModeSense_6(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+static bool SCSI_Command_ModeSense(void)
 {
-	/* Send an empty header response with the Write Protect flag status */
-	Endpoint_Write_8(0x00);
-	Endpoint_Write_8(0x00);
-	Endpoint_Write_8(DISK_READ_ONLY ? 0x80 : 0x00);
-	Endpoint_Write_8(0x00);
+	uint8_t* CommandData      = CommandBlock.SCSICommandData;
+	bool     IsModeSense10    = (CommandData[0] == SCSI_CMD_MODE_SENSE_10);
+	uint8_t  PageControl      = (CommandData[2] >> 6);
+	uint8_t  PageCode         = (CommandData[2] & 0x3F);
+	uint8_t  HeaderLength     = IsModeSense10 ? 8 : 4;
+	uint16_t AllocationLength = IsModeSense10 ? SwapEndian_16(*(uint16_t*)&CommandData[7]) : CommandData[4];
+	uint16_t TotalLength      = HeaderLength;
+	uint8_t  Header[8];
+
+	/* Saved values and subpages are not supported */
+	if ((PageControl == MODE_PAGE_CONTROL_SAVED) || (CommandData[3] && (CommandData[3] != 0xFF)))
+	{
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	for (uint8_t i = 0; i < sizeof(ModePages); i += pgm_read_byte(&ModePages[i + 1]) + 2)
+	{
+		if ((PageCode == MODE_PAGE_ALL) || (PageCode == pgm_read_byte(&ModePages[i])))
+		  TotalLength += pgm_read_byte(&ModePages[i + 1]) + 2;
+	}
+
+	if ((PageCode != MODE_PAGE_ALL) && (TotalLength == HeaderLength))
+	{
+		/* Requested page is not implemented - update the SENSE key and fail the request */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* Header has the mode data length, medium type, Write Protect flag and no block descriptors */
+	memset(Header, 0, sizeof(Header));
+	if (IsModeSense10)
+	{
+		Header[1] = TotalLength - 2;
+		Header[3] = DISK_READ_ONLY ? 0x80 : 0x00;
+	}
+	else
+	{
+		Header[0] = TotalLength - 1;
+		Header[2] = DISK_READ_ONLY ? 0x80 : 0x00;
+	}
+
+	TotalLength = MIN(TotalLength, AllocationLength);
+	uint16_t BytesLeft = TotalLength;
+
+	Endpoint_Write_Stream_LE(Header, MIN(BytesLeft, HeaderLength), NULL);
+	BytesLeft -= MIN(BytesLeft, HeaderLength);
+
+	for (uint8_t i = 0; BytesLeft && (i < sizeof(ModePages)); i += pgm_read_byte(&ModePages[i + 1]) + 2)
+	{
+		if ((PageCode != MODE_PAGE_ALL) && (PageCode != pgm_read_byte(&ModePages[i])))
+		  continue;
+
+		uint8_t PageLength = MIN(BytesLeft, pgm_read_byte(&ModePages[i + 1]) + 2);
+
+		/* None of the parameters can be changed, so report all-zero masks past the page code and length */
+		if (PageControl == MODE_PAGE_CONTROL_CHANGEABLE)
+		{
+			Endpoint_Write_PStream_LE(&ModePages[i], MIN(PageLength, 2), NULL);
+			if (PageLength > 2)
+			  Endpoint_Null_Stream(PageLength - 2, NULL);
+		}
+		else
+		{
+			Endpoint_Write_PStream_LE(&ModePages[i], PageLength, NULL);
+		}
+
+		BytesLeft -= PageLength;
+	}
+
 	Endpoint_ClearIN();
 
 	/* Update the bytes transferred counter and succeed the command */
-	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= 4;
+	CommandBlock.DataTransferLength -= TotalLength;
 
 	return true;
 }
-
@@ -45,6 +45,7 @@
 		#include "../uf2uno.h"
 		#include "../Descriptors.h"
 		#include "DataflashManager.h"
+		#include "MassStorage.h"
 		#include "Config/AppConfig.h"
 
 	/* Macros: */
@@ -72,17 +73,90 @@
 		/** Value for the DeviceType entry in the SCSI_Inquiry_Response_t enum, indicating a CD-ROM device. */
 		#define DEVICE_TYPE_CDROM   0x05
 
+		/* Probe commands issued by hosts at attach time, not all of which are named by the LUFA class driver headers. */
+		#if !defined(SCSI_CMD_READ_FORMAT_CAPACITIES)
+			/** SCSI Command Code for a READ FORMAT CAPACITIES command. */
+			#define SCSI_CMD_READ_FORMAT_CAPACITIES       0x23
+		#endif
+
+		#if !defined(SCSI_CMD_MODE_SENSE_10)
+			/** SCSI Command Code for a MODE SENSE (10) command. */
+			#define SCSI_CMD_MODE_SENSE_10                0x5A
+		#endif
+
+		#if !defined(SCSI_CMD_SERVICE_ACTION_IN_16)
+			/** SCSI Command Code for a SERVICE ACTION IN (16) command, carrying READ CAPACITY (16). */
+			#define SCSI_CMD_SERVICE_ACTION_IN_16         0x9E
+		#endif
+
+		#if !defined(SCSI_CMD_SYNCHRONIZE_CACHE_10)
+			/** SCSI Command Code for a SYNCHRONIZE CACHE (10) command. */
+			#define SCSI_CMD_SYNCHRONIZE_CACHE_10         0x35
+		#endif
+
+		#if !defined(SCSI_CMD_SYNCHRONIZE_CACHE_16)
+			/** SCSI Command Code for a SYNCHRONIZE CACHE (16) command. */
+			#define SCSI_CMD_SYNCHRONIZE_CACHE_16         0x91
+		#endif
+
+		#if !defined(SCSI_ASENSE_WRITE_ERROR)
+			/** SCSI Additional Sense Code to indicate that the medium could not be written. */
+			#define SCSI_ASENSE_WRITE_ERROR               0x0C
+		#endif
+
+		#if !defined(SCSI_ASENSE_MISCOMPARE_DURING_VERIFY)
+			/** SCSI Additional Sense Code to indicate that written data read back different. */
+			#define SCSI_ASENSE_MISCOMPARE_DURING_VERIFY  0x1D
+		#endif
+
+		/** SERVICE ACTION IN (16) service action code for READ CAPACITY (16). */
+		#define SCSI_SA_READ_CAPACITY_16                  0x10
+
+		/** MODE SENSE page code of the Read-Write Error Recovery mode page. */
+		#define MODE_PAGE_RW_ERROR_RECOVERY               0x01
+
+		/** MODE SENSE page code of the Caching mode page. */
+		#define MODE_PAGE_CACHING                         0x08
+
+		/** MODE SENSE page code of the Informational Exceptions Control mode page. */
+		#define MODE_PAGE_INFORMATIONAL_EXCEPTIONS        0x1C
+
+		/** MODE SENSE page code requesting all supported mode pages. */
+		#define MODE_PAGE_ALL                             0x3F
+
+		/** MODE SENSE page control value requesting the mask of changeable values. */
+		#define MODE_PAGE_CONTROL_CHANGEABLE              1
+
+		/** MODE SENSE page control value requesting saved values. */
+		#define MODE_PAGE_CONTROL_SAVED                   3
+
+	/* Type Defines: */
+		/** Type define for a SCSI command handler, processing the command in the current Command Block Wrapper.
+		 *
+		 *  \return Boolean \c true if the command completed successfully, \c false otherwise
+		 */
+		typedef bool (*SCSI_CommandHandler_t)(void);
+
+		/** Type define for an entry of the SCSI command dispatch table. */
+		typedef struct
+		{
+			uint8_t               Command; /**< SCSI command opcode */
+			SCSI_CommandHandler_t Handler; /**< Function processing the command */
+		} SCSI_CommandTableEntry_t;
+
 	/* Function Prototypes: */
-		bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+		bool SCSI_DecodeSCSICommand(void);
 
 		#if defined(INCLUDE_FROM_SCSI_C)
-			static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
-			static bool SCSI_Command_Request_Sense(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
-			static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
-			static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
-			static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
-			                                      const bool IsDataRead);
-			static bool SCSI_Command_ModeSense_6(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool SCSI_Command_Inquiry(void);
+			static bool SCSI_Command_Request_Sense(void);
+			static bool SCSI_Command_Read_Capacity_10(void);
+			static bool SCSI_Command_Read_Capacity_16(void);
+			static bool SCSI_Command_Read_Format_Capacities(void);
+			static bool SCSI_Command_Send_Diagnostic(void);
+			static bool SCSI_Command_No_Data(void);
+			static bool SCSI_Command_ReadWrite_10(void);
+			static bool SCSI_Command_ModeSense(void);
 		#endif
 
 #endif
@@ -0,0 +1,378 @@
+#include "STK500.h"
+
+bool STK500_InProgMode;
+
+// command sequence being run by STK500_Task()
+static uint8_t op;
+static uint8_t step;
+static uint8_t afterSync;
+static uint8_t attempt;
+static uint8_t syncAttempt;
+static bool opResult;
+static uint16_t stepStart;
+static uint16_t stepTimeout;
+static uint32_t pageAddr;
+static uint8_t pageMemtype;
+static uint16_t pageLen;
+static const uint8_t *pageData;
+// bytes of the page still to come with STK500_BeginProgramChunk(), and whether its first chunk has
+// gone out without them, after which it can't be re-sent
+static uint16_t pageLeft;
+static bool pageChunked;
+static uint8_t *readData;
+static uint16_t pageCrc;
+static bool verifyFailed;
+
+/** Checks whether the current step has been running for longer than its timeout. */
+static bool timedOut(void) { return (uint16_t)(TIMER_NOW() - stepStart) >= stepTimeout; }
+
+/** Starts waiting for the given time before moving on to the next step - or, after sending a
+ *  command, for at most that long for its answer, in which case the time has to allow for sending
+ *  the command too.
+ */
+static void delayStep(uint8_t next, uint16_t ms) {
+    step = next;
+    stepStart = TIMER_NOW();
+    stepTimeout = TIMER_TICKS(ms);
+}
+
+/** Checks for the answer to the command sent last.
+ *
+ *  \return \ref STK_RESULT_PENDING while waiting, \ref STK_RESULT_OK if the target acknowledged the
+ *          command, another result on a negative or corrupt answer or timeout
+ */
+static uint8_t replyResult(void) {
+    uint8_t res = STK500_ReplyStatus();
+
+    if (res == STK_RESULT_PENDING && !timedOut())
+        return STK_RESULT_PENDING;
+
+    STK500_CancelReply();
+    if (res == STK_RESULT_PENDING)
+        res = STK_RESULT_NOSYNC;
+    else if (res != STK_RESULT_OK)
+        Counters.BadResponses++;
+
+    return res;
+}
+
+/** Adds \p len bytes of \p data, or of erased flash, to the CRC of the page being programmed. */
+static void addPageCrc(const uint8_t *data, uint16_t len) {
+    for (uint16_t i = 0; i < len; ++i)
+        pageCrc = _crc_ccitt_update(pageCrc, data ? data[i] : 0xff);
+}
+
+static void finish(bool result) {
+    opResult = result;
+    op = STK_OP_NONE;
+}
+
+/** Starts a full reset of the target, after which \c STK500_Task() polls the bootloader with the
+ *  sync command and moves on to the \p next step once it answers.
+ */
+static void beginReset(uint8_t next) {
+    logChar('R');
+    afterSync = next;
+    syncAttempt = 0;
+    AVR_RESET_LINE_PORT &= ~AVR_RESET_LINE_MASK;
+    delayStep(STK_STEP_RESET, TARGET_RESET_PULSE_MS);
+}
+
+/** Re-sends the current page after a failure, first getting back in sync with the bootloader, or
+ *  gives up once all retries are used.
+ */
+static void retryPage(void) {
+    // a failed read is left to the caller
+    if (op == STK_OP_READ_PAGE) {
+        finish(false);
+        return;
+    }
+
+    // the first chunks of the page are gone by the time its end is acknowledged
+    if (pageChunked || ++attempt > PAGE_RETRIES) {
+        Counters.PageFailures++;
+        finish(false);
+        return;
+    }
+
+    Counters.PageRetries++;
+    STK500_SendSync();
+    delayStep(STK_STEP_RESYNC, STK_RESPONSE_TIMEOUT_MS);
+}
+
+static void sendLoadAddress(uint8_t next) {
+    STK500_SendLoadAddress(pageMemtype, pageAddr);
+    delayStep(next, STK_RESPONSE_TIMEOUT_MS);
+}
+
+/** Runs the command sequence in progress as far as it can go without waiting. Call this regularly
+ *  from the main loop, and from anywhere else that waits for the target.
+ */
+void STK500_Task(void) {
+    uint8_t res;
+
+    switch (step) {
+    case STK_STEP_RESET:
+        if (!timedOut())
+            break;
+        AVR_RESET_LINE_PORT |= AVR_RESET_LINE_MASK;
+        delayStep(STK_STEP_STARTUP, TARGET_STARTUP_MS);
+        break;
+
+    case STK_STEP_STARTUP:
+        if (!timedOut())
+            break;
+        // a single outstanding request, so a slow bootloader never sees a backlog of them
+        STK500_SendSync();
+        delayStep(STK_STEP_SYNC, SYNC_TIMEOUT_MS);
+        break;
+
+    case STK_STEP_SYNC:
+        if ((res = replyResult()) == STK_RESULT_PENDING)
+            break;
+        if (res == STK_RESULT_OK) {
+            step = afterSync;
+            if (step == STK_STEP_LOAD_ADDRESS)
+                sendLoadAddress(STK_STEP_LOAD_ADDRESS);
+            else
+                finish(true);
+        } else if (++syncAttempt < SYNC_ATTEMPTS) {
+            logChar('R');
+            AVR_RESET_LINE_PORT &= ~AVR_RESET_LINE_MASK;
+            delayStep(STK_STEP_RESET, TARGET_RESET_PULSE_MS);
+        } else {
+            if (op == STK_OP_PROGRAM_PAGE)
+                Counters.PageFailures++;
+            step = STK_STEP_IDLE;
+            STK500_InProgMode = false;
+            finish(false);
+        }
+        break;
+
+    case STK_STEP_RESYNC:
+        // a lost byte can leave the bootloader waiting for the rest of a command; the stk500v2
+        // one drops the message on its bad checksum and answers the next, but optiboot never
+        // answers and, once it notices the garbage, starts the application - so the fallback is a
+        // full reset
+        if ((res = replyResult()) == STK_RESULT_PENDING)
+            break;
+        if (res == STK_RESULT_OK) {
+            sendLoadAddress(STK_STEP_LOAD_ADDRESS);
+        } else if (TARGET_SEQUENTIAL_PAGES) {
+            // the bootloader would start over erasing from page 0, behind the caller's back
+            Counters.PageFailures++;
+            finish(false);
+        } else {
+            Counters.TargetResets++;
+            beginReset(STK_STEP_LOAD_ADDRESS);
+        }
+        break;
+
+    case STK_STEP_LOAD_ADDRESS:
+        if ((res = replyResult()) == STK_RESULT_PENDING)
+            break;
+        if (res != STK_RESULT_OK) {
+            retryPage();
+            break;
+        }
+        logChar('P');
+        STK500_SendProgramPage(pageMemtype, pageData, pageLen - pageLeft, pageLen);
+        pageChunked = pageLeft;
+        if (pageLeft)
+            step = STK_STEP_PROG_CHUNK;
+        else
+            delayStep(STK_STEP_PROG_PAGE, STK_RESPONSE_TIMEOUT_MS);
+        break;
+
+    case STK_STEP_PROG_CHUNK:
+        // the bootloader answers once it has the whole page, which is up to the caller now
+        if (UCSR1B & (1 << UDRIE1))
+            break;
+        step = STK_STEP_IDLE;
+        finish(true);
+        break;
+
+    case STK_STEP_PROG_PAGE:
+        if ((res = replyResult()) == STK_RESULT_PENDING)
+            break;
+        if (res != STK_RESULT_OK) {
+            retryPage();
+            break;
+        }
+        if (VERIFY_PAGES) {
+            // neither bootloader reads from where the page was programmed without being told
+            sendLoadAddress(STK_STEP_READ_ADDRESS);
+            break;
+        }
+        step = STK_STEP_IDLE;
+        finish(true);
+        break;
+
+    case STK_STEP_READ_ADDRESS:
+        if ((res = replyResult()) == STK_RESULT_PENDING)
+            break;
+        if (res != STK_RESULT_OK) {
+            retryPage();
+            break;
+        }
+        STK500_SendReadPage(pageMemtype, op == STK_OP_READ_PAGE ? readData : NULL, pageLen);
+        delayStep(STK_STEP_READ_PAGE, STK_RESPONSE_TIMEOUT_MS);
+        break;
+
+    case STK_STEP_READ_PAGE:
+        if ((res = replyResult()) == STK_RESULT_PENDING)
+            break;
+        if (res != STK_RESULT_OK) {
+            retryPage();
+            break;
+        }
+        if (op == STK_OP_PROGRAM_PAGE && STK500_ReplyCrc() != pageCrc) {
+            logChar('V');
+            Counters.VerifyFailures++;
+            verifyFailed = true;
+            retryPage();
+            break;
+        }
+        step = STK_STEP_IDLE;
+        finish(true);
+        break;
+
+    case STK_STEP_LEAVE_PROGMODE:
+        if ((res = replyResult()) == STK_RESULT_PENDING)
+            break;
+        if (res != STK_RESULT_OK) {
+            // reset the target the slow way instead
+            AVR_RESET_LINE_PORT &= ~AVR_RESET_LINE_MASK;
+            _delay_ms(TARGET_RESET_PULSE_MS);
+            AVR_RESET_LINE_PORT |= AVR_RESET_LINE_MASK;
+        }
+        // whatever comes next is the sketch talking
+        STK500_InProgMode = false;
+        step = STK_STEP_IDLE;
+        finish(true);
+        break;
+    }
+}
+
+/** Checks whether a command sequence started with one of the \c STK500_Begin* functions is still
+ *  in progress. Only one sequence can run at a time.
+ */
+bool STK500_IsBusy(void) { return op != STK_OP_NONE; }
+
+/** Result of the last command sequence, valid once \ref STK500_IsBusy() returns \c false. */
+bool STK500_Result(void) { return opResult; }
+
+/** Whether the last page programmed read back different from what was sent, with \c VERIFY_PAGES. */
+bool STK500_VerifyFailed(void) { return verifyFailed; }
+
+/** Starts resetting the target and polling its bootloader with the sync command until it answers,
+ *  so that programming can start the moment the bootloader is listening rather than after a fixed
+ *  delay. Succeeds once the bootloader is in sync and waiting for commands.
+ */
+void STK500_BeginEnterBootloader(void) {
+    op = STK_OP_ENTER_BOOTLOADER;
+    STK500_InProgMode = true;
+    beginReset(STK_STEP_IDLE);
+}
+
+/** Starts programming one flash or EEPROM page of the target. If the bootloader does not
+ *  acknowledge a command, or with \c VERIFY_PAGES the page reads back different, it is synced
+ *  again and the page re-sent, up to \ref PAGE_RETRIES times. The page data must stay untouched
+ *  until the sequence is over.
+ *
+ *  A page bigger than the caller can hold goes out in chunks, all in the one program command: the
+ *  sequence is over once the first \p len bytes are sent, and each further chunk follows with
+ *  \ref STK500_BeginProgramChunk(). Such a page can't be re-sent, so it fails on the first error.
+ *
+ *  \param[in] memtype  \c STK_MEMTYPE_FLASH or \c STK_MEMTYPE_EEPROM
+ *  \param[in] addr     Byte address of the page
+ *  \param[in] data     Page contents, or its first chunk; \c NULL for erased flash
+ *  \param[in] len      Number of bytes of \p data
+ *  \param[in] size     Number of bytes to program, \p len unless the page goes out in chunks
+ */
+void STK500_BeginProgramPage(uint8_t memtype, uint32_t addr, const uint8_t *data, uint16_t len,
+                             uint16_t size) {
+    op = STK_OP_PROGRAM_PAGE;
+    attempt = 0;
+    pageAddr = addr;
+    pageMemtype = memtype;
+    pageLen = size;
+    pageLeft = size - len;
+    pageChunked = false;
+    pageData = data;
+    verifyFailed = false;
+
+    // to compare with the CRC of the page as read back, computed as it comes in
+    if (VERIFY_PAGES) {
+        pageCrc = 0xffff;
+        addPageCrc(data, len);
+    }
+    sendLoadAddress(STK_STEP_LOAD_ADDRESS);
+}
+
+/** Starts sending the next chunk of the page started with \ref STK500_BeginProgramPage(). The
+ *  sequence is over once the chunk is sent, or for the last one, once the bootloader has
+ *  acknowledged the whole page.
+ *
+ *  \param[in] data  Contents of the chunk, or \c NULL for erased flash
+ *  \param[in] len   Number of bytes of \p data
+ */
+void STK500_BeginProgramChunk(const uint8_t *data, uint16_t len) {
+    op = STK_OP_PROGRAM_PAGE;
+    pageLeft -= len;
+
+    if (VERIFY_PAGES)
+        addPageCrc(data, len);
+
+    STK500_SendPageData(data, len);
+    if (pageLeft)
+        step = STK_STEP_PROG_CHUNK;
+    else
+        delayStep(STK_STEP_PROG_PAGE, STK_RESPONSE_TIMEOUT_MS);
+}
+
+/** Starts reading one flash or EEPROM page of the target, with the bootloader already in sync. A
+ *  read is not retried, since the caller may just as well read the page again.
+ *
+ *  \param[in]  memtype  \c STK_MEMTYPE_FLASH or \c STK_MEMTYPE_EEPROM
+ *  \param[in]  addr     Byte address of the page
+ *  \param[out] data     Buffer for the contents, filled in as they arrive
+ *  \param[in]  len      Number of bytes to read, even for flash
+ */
+void STK500_BeginReadPage(uint8_t memtype, uint32_t addr, uint8_t *data, uint16_t len) {
+    op = STK_OP_READ_PAGE;
+    pageAddr = addr;
+    pageMemtype = memtype;
+    pageLen = len;
+    readData = data;
+    sendLoadAddress(STK_STEP_READ_ADDRESS);
+}
+
+/** Starts ending the programming session, letting the bootloader start the application right away
+ *  rather than after its timeout. If no answer comes back, the target is reset the slow way.
+ */
+void STK500_BeginStartApp(void) {
+    op = STK_OP_START_APP;
+    STK500_SendLeaveProgmode();
+    delayStep(STK_STEP_LEAVE_PROGMODE, LEAVE_PROGMODE_TIMEOUT_MS);
+}
+
+/** Runs the command sequence in progress to completion.
+ *
+ *  \return Boolean \c true if the sequence succeeded, \c false otherwise
+ */
+bool STK500_Wait(void) {
+    while (STK500_IsBusy())
+        STK500_Task();
+    return opResult;
+}
+
+bool STK500_EnterBootloader(void) {
+    STK500_BeginEnterBootloader();
+    return STK500_Wait();
+}
+
+void STK500_StartApp(void) {
+    STK500_BeginStartApp();
+    STK500_Wait();
+}
@@ -0,0 +1,149 @@
+/** \file
+ *
+ *  Header file for the target programmer. STK500.c runs the command sequences - resets, retries, timeouts -
+ *  over one of two backends, picked in the makefile along with the target board, which frame the commands
+ *  and parse the answers: STK500v1.c speaks STK500v1 to optiboot on the Uno, STK500v2.c speaks STK500v2 to
+ *  the Mega 2560 bootloader.
+ */
+
+#ifndef _STK500_H_
+#define _STK500_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+
+		#include "../uf2uno.h"
+
+		#include <avr/interrupt.h>
+		#include <util/atomic.h>
+		#include <util/crc16.h>
+
+		#include <LUFA/Common/Common.h>
+
+	/* Defines: */
+		/** Memory types of STK_PROG_PAGE, which the STK500v2 backend maps to its own commands. */
+		#define STK_MEMTYPE_FLASH         'F'
+		#define STK_MEMTYPE_EEPROM        'E'
+
+		/** Time the target's reset line is held low. The line is AC-coupled to the target /RESET, so only
+		 *  the falling edge matters, but it must stay low long enough for the coupling capacitor to discharge.
+		 */
+		#define TARGET_RESET_PULSE_MS     1
+
+		#if !defined(TARGET_MEGA2560)
+		/** Start-up delay of the ATmega328P after its reset is released (65 ms with the Uno fuses), during which
+		 *  its UART is not listening yet.
+		 */
+		#define TARGET_STARTUP_MS         70
+
+		/** How long to wait for optiboot to answer STK_GET_SYNC after start-up. This covers its start-up LED
+		 *  flashes, during which the request waits in the target's UART receive buffer.
+		 */
+		#define SYNC_TIMEOUT_MS           500
+
+		/** Number of times the target is reset if optiboot does not answer STK_GET_SYNC. */
+		#define SYNC_ATTEMPTS             3
+
+		/** How long to wait for optiboot to acknowledge a command, counted from when the command is queued.
+		 *  Sending a page takes about 12 ms at 115200 baud, and programming it about 9 ms.
+		 */
+		#define STK_RESPONSE_TIMEOUT_MS   50
+
+		/** Number of times a page is re-sent after optiboot fails to acknowledge it. */
+		#define PAGE_RETRIES              3
+
+		/** Optiboot answers STK_LEAVE_PROGMODE straight away, this allows for a few characters of slack. */
+		#define LEAVE_PROGMODE_TIMEOUT_MS 20
+		#else
+		/** Start-up delay of the ATmega2560 after its reset is released (65 ms with the Mega fuses). */
+		#define TARGET_STARTUP_MS         70
+
+		/** How long to wait for the bootloader to answer CMD_SIGN_ON after start-up. */
+		#define SYNC_TIMEOUT_MS           500
+
+		/** Number of times the target is reset if the bootloader does not answer CMD_SIGN_ON. */
+		#define SYNC_ATTEMPTS             3
+
+		/** How long to wait for the bootloader to answer a command, counted from when the command - or the last
+		 *  chunk of a page - is queued. Sending a 128 byte half page takes about 12 ms at 115200 baud, and erasing
+		 *  and programming the page about 10 ms.
+		 */
+		#define STK_RESPONSE_TIMEOUT_MS   100
+
+		/** Number of times a page is re-sent after the bootloader fails to acknowledge it. */
+		#define PAGE_RETRIES              3
+
+		/** The bootloader answers CMD_LEAVE_PROGMODE_ISP straight away before starting the application. */
+		#define LEAVE_PROGMODE_TIMEOUT_MS 20
+		#endif
+
+	/* Enums: */
+		/** Outcomes of a command, as the backend's parser makes them out. */
+		enum STK500_Results_t
+		{
+			STK_RESULT_PENDING = 0, /**< No complete response received yet */
+			STK_RESULT_OK, /**< Target acknowledged the command */
+			STK_RESULT_FAILED, /**< Target answered with a failure, or a corrupt answer */
+			STK_RESULT_NOSYNC, /**< Target answered out of sync or with garbage, or not at all */
+		};
+
+		/** Command sequences run by \ref STK500_Task(). */
+		enum STK500_Ops_t
+		{
+			STK_OP_NONE = 0, /**< Nothing in progress */
+			STK_OP_ENTER_BOOTLOADER, /**< Resetting the target and syncing with its bootloader */
+			STK_OP_PROGRAM_PAGE, /**< Programming a flash page, with retries */
+			STK_OP_START_APP, /**< Leaving programming mode */
+			STK_OP_READ_PAGE, /**< Reading a flash page, without retries */
+		};
+
+		/** Steps of the command sequences run by \ref STK500_Task(). */
+		enum STK500_Steps_t
+		{
+			STK_STEP_IDLE = 0, /**< Nothing to do */
+			STK_STEP_RESET, /**< Holding the target reset line low */
+			STK_STEP_STARTUP, /**< Waiting for the target to start up after reset */
+			STK_STEP_SYNC, /**< Waiting for the bootloader to answer the sync command after reset */
+			STK_STEP_RESYNC, /**< Waiting for the bootloader to answer the sync command after a failure */
+			STK_STEP_LOAD_ADDRESS, /**< Waiting for the page address to be acknowledged */
+			STK_STEP_PROG_CHUNK, /**< Sending a chunk of the page, the rest of which is still to come */
+			STK_STEP_PROG_PAGE, /**< Waiting for the page to be acknowledged */
+			STK_STEP_READ_ADDRESS, /**< Waiting for the page address to be acknowledged before reading the page */
+			STK_STEP_READ_PAGE, /**< Waiting for the page to be read */
+			STK_STEP_LEAVE_PROGMODE, /**< Waiting for the bootloader to acknowledge leaving programming mode */
+		};
+
+	/* External Variables: */
+		/** Set while the target is in its bootloader, in which case the bytes it sends are STK500 responses for
+		 *  \ref STK500_ReceiveByte() rather than serial data for the host.
+		 */
+		extern bool STK500_InProgMode;
+
+	/* Function Prototypes: */
+		void STK500_ReceiveByte(uint8_t b);
+		void STK500_Task(void);
+		bool STK500_IsBusy(void);
+		bool STK500_Result(void);
+		bool STK500_VerifyFailed(void);
+		bool STK500_Wait(void);
+		void STK500_BeginEnterBootloader(void);
+		void STK500_BeginProgramPage(uint8_t memtype, uint32_t addr, const uint8_t* data, uint16_t len,
+		                             uint16_t size);
+		void STK500_BeginProgramChunk(const uint8_t* data, uint16_t len);
+		void STK500_BeginStartApp(void);
+		void STK500_BeginReadPage(uint8_t memtype, uint32_t addr, uint8_t* data, uint16_t len);
+		bool STK500_EnterBootloader(void);
+		void STK500_StartApp(void);
+
+		/* Backend, framing the commands of the sequences in STK500.c and parsing the answers: */
+		void STK500_SendSync(void);
+		void STK500_SendLoadAddress(uint8_t memtype, uint32_t addr);
+		void STK500_SendProgramPage(uint8_t memtype, const uint8_t* data, uint16_t len, uint16_t size);
+		void STK500_SendPageData(const uint8_t* data, uint16_t len);
+		void STK500_SendReadPage(uint8_t memtype, uint8_t* data, uint16_t len);
+		void STK500_SendLeaveProgmode(void);
+		uint8_t STK500_ReplyStatus(void);
+		void STK500_CancelReply(void);
+		uint16_t STK500_ReplyCrc(void);
+
+#endif
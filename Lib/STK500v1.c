@@ -0,0 +1,175 @@
+#include "STK500v1.h"
+
+// command being sent by the USART data register empty ISR, always terminated with CRC_EOP - once
+// the data still to be queued, for a page sent in chunks, has gone out too
+static uint8_t txHeader[4];
+static uint8_t txHeaderLen;
+static volatile uint8_t txHeaderPos;
+static const uint8_t *volatile txData;
+static volatile uint16_t txDataLeft;
+static uint16_t txDataMore;
+
+// response parser state, shared with the USART receive ISR
+static volatile uint8_t rxState;
+static volatile uint8_t rxResult;
+static uint8_t *rxData;
+static uint16_t rxDataLeft;
+static uint16_t rxCrc;
+
+/** Feeds a byte received from the target into the response parser. Called from the USART receive
+ *  ISR while in programming mode, so none of the programming traffic reaches the serial bridge.
+ *  A response is \c STK_INSYNC, the expected number of data bytes, and \c STK_OK; anything arriving
+ *  while no response is expected is dropped.
+ *
+ *  \param[in] b  Byte received from the target
+ */
+void STK500_ReceiveByte(uint8_t b) {
+    switch (rxState) {
+    case STK_RX_INSYNC:
+        if (b == STK_INSYNC)
+            rxState = rxDataLeft ? STK_RX_DATA : STK_RX_STATUS;
+        else if (b == STK_NOSYNC) {
+            rxResult = STK_RESULT_NOSYNC;
+            rxState = STK_RX_IDLE;
+        }
+        break;
+
+    case STK_RX_DATA:
+        rxCrc = _crc_ccitt_update(rxCrc, b);
+        if (rxData)
+            *rxData++ = b;
+        if (!--rxDataLeft)
+            rxState = STK_RX_STATUS;
+        break;
+
+    case STK_RX_STATUS:
+        rxResult = b == STK_OK ? STK_RESULT_OK : b == STK_FAILED ? STK_RESULT_FAILED
+                                                                  : STK_RESULT_NOSYNC;
+        rxState = STK_RX_IDLE;
+        break;
+
+    default:
+        return;
+    }
+
+    if (rxResult != STK_RESULT_PENDING)
+        Scheduler_Post(EVENT_TARGET);
+}
+
+/** ISR to send the queued STK500 command to the target, one byte per data register empty
+ *  interrupt, finishing with \c CRC_EOP. Without data, erased flash bytes are sent.
+ */
+ISR(USART1_UDRE_vect, ISR_BLOCK) {
+    if (txHeaderPos < txHeaderLen) {
+        UDR1 = txHeader[txHeaderPos++];
+    } else if (txDataLeft) {
+        UDR1 = txData ? *txData++ : 0xff;
+        txDataLeft--;
+    } else {
+        if (!txDataMore)
+            UDR1 = CRC_EOP;
+        UCSR1B &= ~(1 << UDRIE1);
+    }
+}
+
+/** Queues the command in \c txHeader, followed by \p len bytes of \p data and \c CRC_EOP, and arms
+ *  the response parser for a reply without data.
+ *
+ *  \param[in] headerLen  Number of bytes in \c txHeader
+ *  \param[in] data       Data to send after the header, if any
+ *  \param[in] len        Number of bytes of data
+ *  \param[in] more       Number of bytes of data to follow with \ref STK500_SendPageData()
+ */
+static void sendCommand(uint8_t headerLen, const uint8_t *data, uint16_t len, uint16_t more) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        rxDataLeft = 0;
+        rxResult = STK_RESULT_PENDING;
+        rxState = STK_RX_INSYNC;
+
+        txHeaderLen = headerLen;
+        txHeaderPos = 0;
+        txData = data;
+        txDataLeft = len;
+        txDataMore = more;
+        UCSR1B |= (1 << UDRIE1);
+    }
+}
+
+/** Arms the response parser of the command just queued for \p len data bytes before \c STK_OK,
+ *  which go into \p data and into \c rxCrc as they arrive.
+ *
+ *  \param[in] data  Buffer for the data, or \c NULL to only compute their CRC
+ *  \param[in] len   Number of data bytes in the response
+ */
+static void expectData(uint8_t *data, uint16_t len) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        rxData = data;
+        rxDataLeft = len;
+        rxCrc = 0xffff;
+    }
+}
+
+/** Sends \c STK_GET_SYNC, which optiboot answers as soon as it is listening. */
+void STK500_SendSync(void) {
+    txHeader[0] = STK_GET_SYNC;
+    sendCommand(1, NULL, 0, 0);
+}
+
+/** Sends \c STK_LOAD_ADDRESS for the page at byte address \p addr. */
+void STK500_SendLoadAddress(uint8_t memtype, uint32_t addr) {
+    // flash is addressed in words, EEPROM in bytes - as avrdude does it
+    uint16_t a = memtype == STK_MEMTYPE_FLASH ? addr >> 1 : addr;
+
+    txHeader[0] = STK_LOAD_ADDRESS;
+    txHeader[1] = a & 0xff; // little endian
+    txHeader[2] = a >> 8;
+    sendCommand(3, NULL, 0, 0);
+}
+
+/** Sends \c STK_PROG_PAGE for \p size bytes at the address loaded last, the first \p len of them
+ *  from \p data.
+ */
+void STK500_SendProgramPage(uint8_t memtype, const uint8_t *data, uint16_t len, uint16_t size) {
+    txHeader[0] = STK_PROG_PAGE;
+    txHeader[1] = size >> 8; // and big endian here, go figure
+    txHeader[2] = size & 0xff;
+    txHeader[3] = memtype;
+    sendCommand(4, data, len, size - len);
+}
+
+/** Sends the next \p len bytes of the page started with \ref STK500_SendProgramPage(). */
+void STK500_SendPageData(const uint8_t *data, uint16_t len) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        txData = data;
+        txDataLeft = len;
+        txDataMore -= len;
+        UCSR1B |= (1 << UDRIE1);
+    }
+}
+
+/** Sends \c STK_READ_PAGE for \p len bytes from the address loaded last, which go into \p data. */
+void STK500_SendReadPage(uint8_t memtype, uint8_t *data, uint16_t len) {
+    txHeader[0] = STK_READ_PAGE;
+    txHeader[1] = len >> 8;
+    txHeader[2] = len & 0xff;
+    txHeader[3] = memtype;
+    sendCommand(4, NULL, 0, 0);
+    expectData(data, len);
+}
+
+/** Sends \c STK_LEAVE_PROGMODE. Optiboot answers it and then resets itself through its 16ms
+ *  watchdog, which runs the sketch without waiting out the bootloader timeout.
+ */
+void STK500_SendLeaveProgmode(void) {
+    txHeader[0] = STK_LEAVE_PROGMODE;
+    sendCommand(1, NULL, 0, 0);
+}
+
+/** Outcome of the command sent last, \ref STK_RESULT_PENDING until its response is complete. */
+uint8_t STK500_ReplyStatus(void) { return rxResult; }
+
+/** Stops waiting for the response to the command sent last, dropping whatever else comes. */
+void STK500_CancelReply(void) { rxState = STK_RX_IDLE; }
+
+/** CRC of the data bytes of the response to the command sent last. */
+uint16_t STK500_ReplyCrc(void) { return rxCrc; }
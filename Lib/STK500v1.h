@@ -0,0 +1,35 @@
+/** \file
+ *
+ *  Header file for STK500v1.c.
+ */
+
+#ifndef _STK500V1_H_
+#define _STK500V1_H_
+
+	/* Includes: */
+		#include "STK500.h"
+
+	/* Defines: */
+		/** STK500 protocol bytes understood by optiboot. */
+		#define CRC_EOP                   0x20 // 'SPACE'
+		#define STK_OK                    0x10
+		#define STK_FAILED                0x11
+		#define STK_INSYNC                0x14
+		#define STK_NOSYNC                0x15
+		#define STK_GET_SYNC              0x30 // '0'
+		#define STK_LOAD_ADDRESS          0x55 // 'U'
+		#define STK_PROG_PAGE             0x64 // 'd'
+		#define STK_READ_PAGE             0x74 // 't'
+		#define STK_LEAVE_PROGMODE        0x51 // 'Q'
+
+	/* Enums: */
+		/** States of the response parser fed by \ref STK500_ReceiveByte(). */
+		enum STK500v1_RxStates_t
+		{
+			STK_RX_IDLE = 0, /**< No response expected, received bytes are dropped */
+			STK_RX_INSYNC, /**< Waiting for STK_INSYNC */
+			STK_RX_DATA, /**< Receiving the data bytes of the response */
+			STK_RX_STATUS, /**< Waiting for the final status byte */
+		};
+
+#endif
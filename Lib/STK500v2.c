@@ -0,0 +1,262 @@
+#include "STK500v2.h"
+
+// sequence number of the message sent last, which its answer repeats
+static uint8_t sequence;
+
+// message being sent by the USART data register empty ISR, always terminated with its checksum -
+// once the data still to be queued, for a page sent in chunks, has gone out too
+static uint8_t txHeader[15];
+static uint8_t txHeaderLen;
+static volatile uint8_t txHeaderPos;
+static const uint8_t *volatile txData;
+static volatile uint16_t txDataLeft;
+static uint16_t txDataMore;
+static uint8_t txChecksum;
+
+// answer parser state, shared with the USART receive ISR
+static volatile uint8_t rxState;
+static volatile uint8_t rxResult;
+static uint8_t rxChecksum;
+static uint16_t rxBodyLeft;
+static uint8_t rxBodyPos;
+static bool rxStatusOk;
+static uint8_t *rxData;
+static uint16_t rxDataLeft;
+static uint16_t rxCrc;
+
+/** Feeds a byte received from the target into the answer parser. Called from the USART receive
+ *  ISR while in programming mode, so none of the programming traffic reaches the serial bridge.
+ *  An answer is a message with the sequence number of the command, whose body starts with the
+ *  command byte followed by \c STATUS_CMD_OK; anything before \c MESSAGE_START is dropped.
+ *
+ *  \param[in] b  Byte received from the target
+ */
+void STK500_ReceiveByte(uint8_t b) {
+    rxChecksum ^= b;
+
+    switch (rxState) {
+    case V2_RX_START:
+        if (b == MESSAGE_START) {
+            rxChecksum = MESSAGE_START;
+            rxState = V2_RX_SEQUENCE;
+        }
+        return;
+
+    case V2_RX_SEQUENCE:
+        if (b != sequence)
+            break;
+        rxState = V2_RX_SIZE_HI;
+        return;
+
+    case V2_RX_SIZE_HI:
+        rxBodyLeft = b << 8;
+        rxState = V2_RX_SIZE_LO;
+        return;
+
+    case V2_RX_SIZE_LO:
+        rxBodyLeft |= b;
+        rxState = V2_RX_TOKEN;
+        return;
+
+    case V2_RX_TOKEN:
+        if (b != TOKEN || rxBodyLeft < 2)
+            break;
+        rxBodyPos = 0;
+        rxState = V2_RX_BODY;
+        return;
+
+    case V2_RX_BODY:
+        // the answer echoes the command, then gives its status, then any data; anything after
+        // that is ignored
+        if (rxBodyPos == 0)
+            rxStatusOk = b == txHeader[5];
+        else if (rxBodyPos == 1)
+            rxStatusOk = rxStatusOk && b == STATUS_CMD_OK;
+        else if (rxDataLeft) {
+            rxCrc = _crc_ccitt_update(rxCrc, b);
+            if (rxData)
+                *rxData++ = b;
+            rxDataLeft--;
+        }
+        if (rxBodyPos < 2)
+            rxBodyPos++;
+        if (!--rxBodyLeft)
+            rxState = V2_RX_CHECKSUM;
+        return;
+
+    case V2_RX_CHECKSUM:
+        // the checksum makes the XOR of the whole message zero
+        rxResult = rxChecksum == 0 && rxStatusOk && !rxDataLeft ? STK_RESULT_OK : STK_RESULT_FAILED;
+        rxState = V2_RX_IDLE;
+        Scheduler_Post(EVENT_TARGET);
+        return;
+
+    default:
+        return;
+    }
+
+    rxResult = STK_RESULT_NOSYNC;
+    rxState = V2_RX_IDLE;
+    Scheduler_Post(EVENT_TARGET);
+}
+
+/** ISR to send the queued STK500v2 message to the target, one byte per data register empty
+ *  interrupt, finishing with its checksum. Without data, erased flash bytes are sent.
+ */
+ISR(USART1_UDRE_vect, ISR_BLOCK) {
+    uint8_t b;
+
+    if (txHeaderPos < txHeaderLen) {
+        b = txHeader[txHeaderPos++];
+    } else if (txDataLeft) {
+        b = txData ? *txData++ : 0xff;
+        txDataLeft--;
+    } else {
+        if (!txDataMore)
+            UDR1 = txChecksum;
+        UCSR1B &= ~(1 << UDRIE1);
+        return;
+    }
+
+    txChecksum ^= b;
+    UDR1 = b;
+}
+
+/** Queues a message with the command body in \c txHeader from offset 5, followed by \p len bytes
+ *  of \p data, and arms the answer parser. The message framing is filled in here.
+ *
+ *  \param[in] bodyLen  Number of bytes of the command body in \c txHeader
+ *  \param[in] data     Data to send after the command body, if any
+ *  \param[in] len      Number of bytes of data
+ *  \param[in] more     Number of bytes of data to follow with \ref STK500_SendPageData()
+ */
+static void sendCommand(uint8_t bodyLen, const uint8_t *data, uint16_t len, uint16_t more) {
+    uint16_t size = bodyLen + len + more;
+
+    txHeader[0] = MESSAGE_START;
+    txHeader[1] = ++sequence;
+    txHeader[2] = size >> 8;
+    txHeader[3] = size & 0xff;
+    txHeader[4] = TOKEN;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        rxDataLeft = 0;
+        rxResult = STK_RESULT_PENDING;
+        rxState = V2_RX_START;
+
+        txHeaderLen = 5 + bodyLen;
+        txHeaderPos = 0;
+        txData = data;
+        txDataLeft = len;
+        txDataMore = more;
+        txChecksum = 0;
+        UCSR1B |= (1 << UDRIE1);
+    }
+}
+
+/** Arms the answer parser of the command just queued for \p len data bytes after its status,
+ *  which go into \p data and into \c rxCrc as they arrive.
+ *
+ *  \param[in] data  Buffer for the data, or \c NULL to only compute their CRC
+ *  \param[in] len   Number of data bytes in the answer
+ */
+static void expectData(uint8_t *data, uint16_t len) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        rxData = data;
+        rxDataLeft = len;
+        rxCrc = 0xffff;
+    }
+}
+
+/** Sends \c CMD_SIGN_ON, which the bootloader answers as soon as it is listening. A message with a
+ *  bad checksum is dropped by the bootloader, so this also gets it back after a lost byte.
+ */
+void STK500_SendSync(void) {
+    txHeader[5] = CMD_SIGN_ON;
+    sendCommand(1, NULL, 0, 0);
+}
+
+/** Sends \c CMD_LOAD_ADDRESS for the page at byte address \p addr. */
+void STK500_SendLoadAddress(uint8_t memtype, uint32_t addr) {
+    // big endian, in words for flash and in bytes for EEPROM - as avrdude does it
+    if (memtype == STK_MEMTYPE_FLASH)
+        addr = (addr >> 1) | LOAD_ADDRESS_EXTENDED;
+
+    txHeader[5] = CMD_LOAD_ADDRESS;
+    txHeader[6] = addr >> 24;
+    txHeader[7] = addr >> 16;
+    txHeader[8] = addr >> 8;
+    txHeader[9] = addr & 0xff;
+    sendCommand(5, NULL, 0, 0);
+}
+
+/** Sends \c CMD_PROGRAM_FLASH_ISP or \c CMD_PROGRAM_EEPROM_ISP for \p size bytes at the address
+ *  loaded last, the first \p len of them from \p data. The bootloader only acts on the message
+ *  once it has all of it, and waits seconds for the rest.
+ */
+void STK500_SendProgramPage(uint8_t memtype, const uint8_t *data, uint16_t len, uint16_t size) {
+    txHeader[6] = size >> 8;
+    txHeader[7] = size & 0xff;
+    if (memtype == STK_MEMTYPE_FLASH) {
+        txHeader[5] = CMD_PROGRAM_FLASH_ISP;
+        txHeader[8] = PROGRAM_FLASH_MODE;
+        txHeader[9] = PROGRAM_FLASH_DELAY;
+        txHeader[10] = PROGRAM_FLASH_CMD1;
+        txHeader[11] = PROGRAM_FLASH_CMD2;
+        txHeader[12] = PROGRAM_FLASH_CMD3;
+    } else {
+        txHeader[5] = CMD_PROGRAM_EEPROM_ISP;
+        txHeader[8] = PROGRAM_EEPROM_MODE;
+        txHeader[9] = PROGRAM_EEPROM_DELAY;
+        txHeader[10] = PROGRAM_EEPROM_CMD1;
+        txHeader[11] = PROGRAM_EEPROM_CMD2;
+        txHeader[12] = PROGRAM_EEPROM_CMD3;
+    }
+    txHeader[13] = 0x00; // poll values
+    txHeader[14] = 0x00;
+    sendCommand(10, data, len, size - len);
+}
+
+/** Sends the next \p len bytes of the page started with \ref STK500_SendProgramPage(). */
+void STK500_SendPageData(const uint8_t *data, uint16_t len) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        txData = data;
+        txDataLeft = len;
+        txDataMore -= len;
+        UCSR1B |= (1 << UDRIE1);
+    }
+}
+
+/** Sends \c CMD_READ_FLASH_ISP or \c CMD_READ_EEPROM_ISP for \p len bytes from the address loaded
+ *  last, which go into \p data.
+ */
+void STK500_SendReadPage(uint8_t memtype, uint8_t *data, uint16_t len) {
+    if (memtype == STK_MEMTYPE_FLASH) {
+        txHeader[5] = CMD_READ_FLASH_ISP;
+        txHeader[8] = READ_FLASH_CMD1;
+    } else {
+        txHeader[5] = CMD_READ_EEPROM_ISP;
+        txHeader[8] = READ_EEPROM_CMD1;
+    }
+    txHeader[6] = len >> 8;
+    txHeader[7] = len & 0xff;
+    sendCommand(4, NULL, 0, 0);
+    expectData(data, len);
+}
+
+/** Sends \c CMD_LEAVE_PROGMODE_ISP. The bootloader answers it and then jumps to the application. */
+void STK500_SendLeaveProgmode(void) {
+    txHeader[5] = CMD_LEAVE_PROGMODE_ISP;
+    txHeader[6] = 1; // pre and post delay
+    txHeader[7] = 1;
+    sendCommand(3, NULL, 0, 0);
+}
+
+/** Outcome of the command sent last, \ref STK_RESULT_PENDING until its answer is complete. */
+uint8_t STK500_ReplyStatus(void) { return rxResult; }
+
+/** Stops waiting for the answer to the command sent last, dropping whatever else comes. */
+void STK500_CancelReply(void) { rxState = V2_RX_IDLE; }
+
+/** CRC of the data bytes of the answer to the command sent last. */
+uint16_t STK500_ReplyCrc(void) { return rxCrc; }
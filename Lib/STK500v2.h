@@ -0,0 +1,70 @@
+/** \file
+ *
+ *  Header file for STK500v2.c.
+ */
+
+#ifndef _STK500V2_H_
+#define _STK500V2_H_
+
+	/* Includes: */
+		#include "STK500.h"
+
+	/* Defines: */
+		/** STK500v2 message framing: MESSAGE_START, sequence number, 16-bit big endian body size, TOKEN, body, and
+		 *  the XOR of all preceding bytes of the message.
+		 */
+		#define MESSAGE_START             0x1B
+		#define TOKEN                     0x0E
+
+		/** STK500v2 commands used with the Mega 2560 bootloader. */
+		#define CMD_SIGN_ON               0x01
+		#define CMD_LOAD_ADDRESS          0x06
+		#define CMD_LEAVE_PROGMODE_ISP    0x11
+		#define CMD_PROGRAM_FLASH_ISP     0x13
+		#define CMD_READ_FLASH_ISP        0x14
+		#define CMD_PROGRAM_EEPROM_ISP    0x15
+		#define CMD_READ_EEPROM_ISP       0x16
+
+		/** Status of a successful command, the second byte of each answer. */
+		#define STATUS_CMD_OK             0x00
+
+		/** Set in the address of CMD_LOAD_ADDRESS for parts with more than 64K words of flash, so that the
+		 *  bootloader selects the upper flash with its extended address byte.
+		 */
+		#define LOAD_ADDRESS_EXTENDED     0x80000000UL
+
+		/** CMD_PROGRAM_FLASH_ISP parameters for whole-page writes, as avrdude sends them for the ATmega2560. The
+		 *  bootloader only looks at the byte count.
+		 */
+		#define PROGRAM_FLASH_MODE        0xC1
+		#define PROGRAM_FLASH_DELAY       10
+		#define PROGRAM_FLASH_CMD1        0x40
+		#define PROGRAM_FLASH_CMD2        0x4C
+		#define PROGRAM_FLASH_CMD3        0x20
+
+		/** CMD_PROGRAM_EEPROM_ISP parameters, likewise. */
+		#define PROGRAM_EEPROM_MODE       0x41
+		#define PROGRAM_EEPROM_DELAY      10
+		#define PROGRAM_EEPROM_CMD1       0xC1
+		#define PROGRAM_EEPROM_CMD2       0xC2
+		#define PROGRAM_EEPROM_CMD3       0xA0
+
+		/** CMD_READ_FLASH_ISP and CMD_READ_EEPROM_ISP read instructions, likewise ignored by the bootloader. */
+		#define READ_FLASH_CMD1           0x20
+		#define READ_EEPROM_CMD1          0xA0
+
+	/* Enums: */
+		/** States of the answer parser fed by \ref STK500_ReceiveByte(). */
+		enum STK500v2_RxStates_t
+		{
+			V2_RX_IDLE = 0, /**< No answer expected, received bytes are dropped */
+			V2_RX_START, /**< Waiting for MESSAGE_START */
+			V2_RX_SEQUENCE, /**< Waiting for the sequence number of the command */
+			V2_RX_SIZE_HI, /**< Receiving the body size */
+			V2_RX_SIZE_LO,
+			V2_RX_TOKEN, /**< Waiting for TOKEN */
+			V2_RX_BODY, /**< Receiving the answer body */
+			V2_RX_CHECKSUM, /**< Waiting for the checksum */
+		};
+
+#endif
@@ -0,0 +1,82 @@
+/** \file
+ *
+ *  Event flags for the cooperative main loop scheduler. Interrupt handlers post events, and the main
+ *  loop runs the tasks waiting on them, sleeping in idle mode while nothing is pending.
+ */
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <avr/sleep.h>
+
+		#include <LUFA/Common/Common.h>
+
+	/* Defines: */
+		/** Register holding the pending events. GPIOR0 is in the bit-addressable I/O space, so posting a single
+		 *  event compiles to one atomic SBI instruction, safe from both ISRs and the main loop.
+		 */
+		#define EVENT_REGISTER           GPIOR0
+
+		/** Event posted on every USB start of frame, and whenever an endpoint may still hold data, to run the
+		 *  Mass Storage and HID tasks.
+		 */
+		#define EVENT_USB                (1 << 0)
+
+		/** Event posted on every TIMER0 overflow (about every 4 ms), for the serial flush timer, LED pulses and
+		 *  target timeouts.
+		 */
+		#define EVENT_TICK               (1 << 1)
+
+		/** Event posted when a byte from the target was placed in the USART to USB buffer. */
+		#define EVENT_SERIAL_RX          (1 << 2)
+
+		/** Event posted when bytes from the host are waiting to be sent to the target. */
+		#define EVENT_SERIAL_TX          (1 << 3)
+
+		/** Event posted when the target has answered an STK500 command. */
+		#define EVENT_TARGET             (1 << 4)
+
+	/* Inline Functions: */
+		/** Posts a single event, to be picked up by the next \ref Scheduler_WaitForEvents() call.
+		 *
+		 *  \param[in] Event  Event to post, one of the \c EVENT_* masks
+		 */
+		static inline void Scheduler_Post(const uint8_t Event)
+		{
+			EVENT_REGISTER |= Event;
+		}
+
+		/** Waits until at least one event is pending, sleeping in idle mode meanwhile, and then takes all of the
+		 *  pending events. Any interrupt wakes the CPU; interrupts are only re-enabled immediately before the
+		 *  SLEEP instruction, so an event posted while checking cannot be missed.
+		 *
+		 *  \return Mask of the events that were pending
+		 */
+		static inline uint8_t Scheduler_WaitForEvents(void)
+		{
+			uint8_t Events;
+
+			set_sleep_mode(SLEEP_MODE_IDLE);
+
+			for (;;)
+			{
+				GlobalInterruptDisable();
+
+				if ((Events = EVENT_REGISTER) != 0)
+				  break;
+
+				sleep_enable();
+				GlobalInterruptEnable();
+				sleep_cpu();
+				sleep_disable();
+			}
+
+			EVENT_REGISTER = 0;
+			GlobalInterruptEnable();
+
+			return Events;
+		}
+
+#endif
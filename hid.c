@@ -1,100 +1,194 @@
 #include "uf2uno.h"
 #include "uf2hid.h"
+#include "Lib/STK500.h"
 
-uint8_t hidBuffer[HID_IO_EPSIZE];
+// HF2 packets are read and written straight from and to the endpoint banks, which saves holding a
+// copy of them in RAM; these count the bytes of the reply, and of its current packet, still to come
+static uint8_t replyLeft;
+static uint8_t packetLeft;
 
-static void hidSendCore(void) {
+/** Starts an HF2 packet with the given header byte, once the IN endpoint is free. */
+static void hidBeginPacket(uint8_t header) {
     Endpoint_SelectEndpoint(HID_IN_EPADDR);
     Endpoint_WaitUntilReady();
     while (!Endpoint_IsINReady())
         ;
-    for (uint8_t i = 0; i < sizeof(hidBuffer); ++i)
-        Endpoint_Write_8(hidBuffer[i]);
+    Endpoint_Write_8(header);
+}
+
+/** Sends the HF2 packet written so far, padded out to the full report size. */
+static void hidEndPacket(void) {
+    while (Endpoint_BytesInEndpoint() < HID_IO_EPSIZE)
+        Endpoint_Write_8(0);
     Endpoint_ClearIN();
-    hidBuffer[0] = 0;
 }
 
-void hidSendReply(void) {
-    hidBuffer[0] |= 0x40;
-    hidSendCore();
+/** Starts a reply of \p size bytes, which the following writes fill in. Its packets are sent as
+ *  they fill up, the last one marked as such.
+ */
+static void hidBeginReply(uint8_t size) {
+    replyLeft = size;
+    packetLeft = 0;
 }
 
-static void checkFlush(void) {
-    if (hidBuffer[0] == HID_IO_EPSIZE - 1)
-        hidSendCore();
+static void hidWrite8(uint8_t b) {
+    if (!packetLeft) {
+        packetLeft = replyLeft < HID_IO_EPSIZE - 1 ? replyLeft : HID_IO_EPSIZE - 1;
+        hidBeginPacket((packetLeft == replyLeft ? HF2_FLAG_CMDPKT_LAST : HF2_FLAG_CMDPKT_BODY) |
+                       packetLeft);
+    }
+
+    Endpoint_Write_8(b);
+    replyLeft--;
+    if (!--packetLeft)
+        hidEndPacket();
 }
 
 void hidWrite(const void *ptr, uint8_t size) {
-    while (size--) {
-        hidBuffer[++hidBuffer[0]] = *(uint8_t *)ptr++;
-        checkFlush();
-    }
+    while (size--)
+        hidWrite8(*(uint8_t *)ptr++);
 }
 
 void hidWrite_P(const void *ptr, uint8_t size) {
-    while (size--) {
-        hidBuffer[++hidBuffer[0]] = pgm_read_byte(ptr++);
-        checkFlush();
-    }
+    while (size--)
+        hidWrite8(pgm_read_byte(ptr++));
+}
+
+/** Reads the next byte of an HF2 packet from the OUT endpoint, or zero past its end - a bulk packet
+ *  only holds as much as the host sent.
+ */
+static uint8_t hidRead8(void) { return Endpoint_BytesInEndpoint() ? Endpoint_Read_8() : 0; }
+
+static void hidRead(void *ptr, uint8_t size) {
+    while (size--)
+        *(uint8_t *)ptr++ = hidRead8();
 }
 
-struct HF2_Command {
-    uint32_t command_id;
-    uint16_t tag;
-    uint8_t reserved0;
-    uint8_t reserved1;
-    uint8_t data[0];
-};
+// reset command being carried out on the target, whose reply goes out once it is through - one of
+// the HF2_CMD_RESET_* commands, or RESET_STARTING_APP once RESET_INTO_APP has synced; and its tag
+#define RESET_STARTING_APP 0xff
+static uint8_t resetCommand;
+static uint16_t resetTag;
+
+/** Checks whether an HF2 reset command still has the target, or has yet to send its reply. */
+bool HID_IsResetting(void) { return resetCommand; }
+
+/** Moves the reset command in progress on once the target is through with its current step, and
+ *  sends its reply once it is done.
+ */
+static void resetTask(void) {
+    uint32_t tmp = resetTag;
+
+    if (!resetCommand || STK500_IsBusy())
+        return;
+
+    if (resetCommand == HF2_CMD_RESET_INTO_APP) {
+        // syncing with optiboot first lets the app start straight away rather than after the
+        // bootloader timeout; if it doesn't answer, the reset has started the app anyway
+        if (STK500_Result()) {
+            STK500_BeginStartApp();
+            resetCommand = RESET_STARTING_APP;
+            return;
+        }
+    } else if (resetCommand == HF2_CMD_RESET_INTO_BOOTLOADER) {
+        if (STK500_Result()) {
+            // the host may program the target on its own from here, so the serial bridge goes
+            // back to forwarding both ways - once the bootloader times out, whatever the sketch
+            // sends reaches the host as usual
+            STK500_InProgMode = false;
+            DataflashManager_InvalidateCrcMap();
+        } else {
+            tmp |= (uint32_t)HF2_STATUS_EXEC_ERR << 16;
+        }
+    }
+
+    resetCommand = 0;
+
+    // nobody to reply to once the host has gone
+    if (USB_DeviceState != DEVICE_STATE_Configured)
+        return;
+
+    hidBeginReply(4);
+    hidWrite(&tmp, 4);
+}
 
 extern const char infoUf2File[] PROGMEM;
 
 void HID_Task(void) {
+    resetTask();
+
     /* Device must be connected and configured for the task to run */
     if (USB_DeviceState != DEVICE_STATE_Configured)
         return;
 
     Endpoint_SelectEndpoint(HID_OUT_EPADDR);
 
-    /* Check to see if a packet has been sent from the host */
-    if (Endpoint_IsOUTReceived()) {
-        uint8_t data[64];
-
+    /* Check to see if a packet has been sent from the host, other than serial data still being sent on */
+    if (!serialPending && Endpoint_IsOUTReceived()) {
         /* Check to see if the packet contains data */
         if (Endpoint_IsReadWriteAllowed()) {
-
-            for (uint8_t i = 0; i < HID_IO_EPSIZE; ++i)
-                data[i] = Endpoint_Read_8();
-
-            Endpoint_ClearOUT();
-
-            if (data[0] & 0x80) {
-                data[0] &= 63;
-                for (uint8_t i = 0; i < data[0]; ++i) {
-                    RingBuffer_Insert(&USBtoUSART_Buffer, data[i + 1]);
-                }
+            uint8_t header = Endpoint_Read_8();
+
+            if (header & HF2_FLAG_SERIAL_OUT) {
+                // left in the endpoint for Serial_Task(), which hands the packet back once the
+                // USART has taken it all - the host is held off meanwhile
+                serialPending = header & HF2_SIZE_MASK;
+                if (serialPending > Endpoint_BytesInEndpoint())
+                    serialPending = Endpoint_BytesInEndpoint();
+                if (!serialPending)
+                    Endpoint_ClearOUT();
+                Scheduler_Post(EVENT_SERIAL_TX);
             } else {
-                struct HF2_Command *cmd = (void *)(data + 1);
-                uint32_t tmp = cmd->tag; // implicit zero status
-                if (cmd->command_id == HF2_CMD_BININFO) {
+                uint32_t command_id;
+                uint32_t tmp = 0; // tag, and implicit zero status
+                hidRead(&command_id, 4);
+                hidRead(&tmp, 2);
+                Endpoint_ClearOUT();
+
+                if (command_id == HF2_CMD_BININFO) {
+                    hidBeginReply(4 + 5 * 4);
                     hidWrite(&tmp, 4);
                     tmp = HF2_MODE_BOOTLOADER;
                     hidWrite(&tmp, 4);
-                    tmp = SPM_PAGESIZE;
+                    tmp = TARGET_PAGESIZE;
                     hidWrite(&tmp, 4);
-                    tmp = 32 * (1024 / SPM_PAGESIZE);
+                    tmp = TARGET_FLASH_SIZE / TARGET_PAGESIZE;
                     hidWrite(&tmp, 4);
                     tmp = HID_IO_EPSIZE - 1;
                     hidWrite(&tmp, 4);
-                } else if (cmd->command_id == HF2_CMD_INFO) {
+                    tmp = UF2_FAMILY_ID;
+                    hidWrite(&tmp, 4);
+                } else if (command_id == HF2_CMD_INFO) {
+                    hidBeginReply(4 + strlen_P(infoUf2File));
                     hidWrite(&tmp, 4);
                     hidWrite_P(infoUf2File, strlen_P(infoUf2File));
+                } else if (command_id == HF2_CMD_COUNTERS) {
+                    hidBeginReply(4 + sizeof(Counters));
+                    hidWrite(&tmp, 4);
+                    hidWrite(&Counters, sizeof(Counters));
+                } else if (command_id == HF2_CMD_RESET_INTO_APP ||
+                           command_id == HF2_CMD_RESET_INTO_BOOTLOADER) {
+                    // the target is reset, not us, which takes up to a couple of seconds - the
+                    // reply goes out from resetTask() once it is done; this can't be done while
+                    // the target is being flashed or read, even between two commands
+                    if (resetCommand || DataflashManager_IsBusy()) {
+                        tmp |= (uint32_t)HF2_STATUS_EXEC_ERR << 16;
+                        hidBeginReply(4);
+                        hidWrite(&tmp, 4);
+                    } else {
+                        resetCommand = command_id;
+                        resetTag = tmp;
+                        STK500_BeginEnterBootloader();
+                    }
                 } else {
-                    hidWrite(&tmp, 2);
-                    tmp = 1; // command not understood
-                    hidWrite(&tmp, 2);
+                    tmp |= (uint32_t)HF2_STATUS_INVALID_CMD << 16;
+                    hidBeginReply(4);
+                    hidWrite(&tmp, 4);
                 }
-                hidSendReply();
             }
+        } else {
+            /* An empty packet, which a bulk host may send, is just handed back */
+            Endpoint_ClearOUT();
         }
     }
 
@@ -110,11 +204,10 @@ void HID_Task(void) {
                 needsFlush = 1;
             }
 
+            Endpoint_Write_8(HF2_FLAG_SERIAL_OUT | len);
             for (uint8_t i = 0; i < len; ++i)
-                hidBuffer[i + 1] = RingBuffer_Remove(&USARTtoUSB_Buffer);
-
-            hidBuffer[0] = 0x80 | len;
-            hidSendCore();
+                Endpoint_Write_8(RingBuffer_Remove(&USARTtoUSB_Buffer));
+            hidEndPacket();
         }
     }
 }
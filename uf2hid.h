@@ -62,6 +62,11 @@ struct HF2_WRITE_WORDS_Command {
 // no arguments
 // results is utf8 character array
 
+// device specific, outside of the range used by HF2
+#define HF2_CMD_COUNTERS 0x8001
+// no arguments
+// result is Counters_t from uf2uno.h
+
 typedef struct {
     uint32_t command_id;
     uint16_t tag;
@@ -102,5 +107,6 @@ typedef struct {
 
 #define HF2_STATUS_OK 0x00
 #define HF2_STATUS_INVALID_CMD 0x01
+#define HF2_STATUS_EXEC_ERR 0x02
 
 #endif
@@ -34,41 +34,21 @@
  *  the demo and is responsible for the initial application hardware configuration.
  */
 
+#define  INCLUDE_FROM_UF2UNO_C
 #include "uf2uno.h"
 
-/** LUFA Mass Storage Class driver interface configuration and state information. This structure is
- *  passed to all Mass Storage Class driver functions, so that multiple instances of the same class
- *  within a device can be differentiated from one another.
- */
-USB_ClassInfo_MS_Device_t Disk_MS_Interface =
-	{
-		.Config =
-			{
-				.InterfaceNumber                = INTERFACE_ID_MassStorage,
-				.DataINEndpoint                 =
-					{
-						.Address                = MASS_STORAGE_IN_EPADDR,
-						.Size                   = MASS_STORAGE_IO_EPSIZE,
-						.Banks                  = 1,
-					},
-				.DataOUTEndpoint                =
-					{
-						.Address                = MASS_STORAGE_OUT_EPADDR,
-						.Size                   = MASS_STORAGE_IO_EPSIZE,
-						.Banks                  = 1,
-					},
-				.TotalLUNs                      = TOTAL_LUNS,
-			},
-	};
-
-/** Circular buffer to hold data from the host before it is sent to the device via the serial port. */
-RingBuff_t USBtoUSART_Buffer;
-
 /** Circular buffer to hold data from the serial port before it is sent to the host. */
 RingBuff_t USARTtoUSB_Buffer;
 
 uint8_t needsFlush;
 
+/** Bytes of serial data from the host still waiting in the HID OUT endpoint. The packet is left there until the
+ *  USART has taken all of it, which holds the host off rather than buffering its data here.
+ */
+uint8_t serialPending;
+
+Counters_t Counters;
+
 /** Pulse generation counters to keep track of the number of milliseconds remaining for each pulse type */
 volatile struct
 {
@@ -88,7 +68,6 @@ int main(void)
 {
 	SetupHardware();
 
-	RingBuffer_InitBuffer(&USBtoUSART_Buffer);
 	RingBuffer_InitBuffer(&USARTtoUSB_Buffer);
 
 	LEDs_SetAllLEDs(LEDMASK_ERROR);
@@ -96,12 +75,12 @@ int main(void)
 
 	for (;;)
 	{
+		uint8_t Events = Scheduler_WaitForEvents();
+
 		/* Check if the UART receive buffer flush timer has expired or the buffer is nearly full */
 		RingBuff_Count_t BufferCount = RingBuffer_GetCount(&USARTtoUSB_Buffer);
-		if ((TIFR0 & (1 << TOV0)) || (BufferCount > BUFFER_NEARLY_FULL))
+		if ((Events & EVENT_TICK) || (BufferCount > BUFFER_NEARLY_FULL))
 		{
-			TIFR0 |= (1 << TOV0);
-
 			if (BufferCount) {
 				//LEDs_TurnOnLEDs(LEDMASK_TX);
 				//PulseMSRemaining.TxLEDPulse = TX_RX_LED_PULSE_MS;
@@ -118,21 +97,69 @@ int main(void)
 			if (PulseMSRemaining.RxLEDPulse && !(--PulseMSRemaining.RxLEDPulse))
 			  LEDs_TurnOffLEDs(LEDMASK_RX);
 		}
-		
-		/* Load the next byte from the USART transmit buffer into the USART */
-		if (!(RingBuffer_IsEmpty(&USBtoUSART_Buffer))) {
-		    Serial_SendByte(RingBuffer_Remove(&USBtoUSART_Buffer));
-		  	
-		  	//LEDs_TurnOnLEDs(LEDMASK_RX);
-			//PulseMSRemaining.RxLEDPulse = TX_RX_LED_PULSE_MS;
-		}
-	
-		MS_Device_USBTask(&Disk_MS_Interface);
-		HID_Task();
-		USB_USBTask();
+
+		/* Bytes held back while the target was being programmed are picked up on the next tick */
+		if (Events & (EVENT_SERIAL_TX | EVENT_TICK))
+		  Serial_Task();
+
+		/* Target replies are handled straight away, timeouts on the next tick */
+		if (Events & (EVENT_TARGET | EVENT_TICK))
+		  STK500_Task();
+
+		/* Complete a flashing session the host has stopped writing to */
+		if (Events & EVENT_TICK)
+		  DataflashManager_Task();
+
+		/* The tick keeps the control endpoint serviced before configuration and while suspended */
+		if (Events & (EVENT_USB | EVENT_TICK))
+		  USB_Tasks();
 	}
 }
 
+/** Loads the next byte of serial data from the HID OUT endpoint into the USART, unless the UART is busy programming
+ *  the target. Runs again for as long as bytes remain, without waiting for them to go out.
+ */
+static void Serial_Task(void)
+{
+	if (STK500_InProgMode || !(serialPending))
+	  return;
+
+	if (Serial_IsSendReady()) {
+		Endpoint_SelectEndpoint(HID_OUT_EPADDR);
+		Serial_SendByte(Endpoint_Read_8());
+
+		/* Hand the packet back to the USB controller once the USART has taken all of it */
+		if (!(--serialPending))
+		  Endpoint_ClearOUT();
+
+		//LEDs_TurnOnLEDs(LEDMASK_RX);
+		//PulseMSRemaining.RxLEDPulse = TX_RX_LED_PULSE_MS;
+	}
+
+	Scheduler_Post(EVENT_SERIAL_TX);
+}
+
+/** Runs the USB interface tasks. A Mass Storage command or HID report may be followed by the next one
+ *  within the same frame, so the tasks are run again straight away while the host keeps sending, rather
+ *  than on the next start of frame.
+ */
+static void USB_Tasks(void)
+{
+	bool Pending;
+
+	Endpoint_SelectEndpoint(MASS_STORAGE_OUT_EPADDR);
+	Pending = Endpoint_IsOUTReceived();
+	Endpoint_SelectEndpoint(HID_OUT_EPADDR);
+	Pending |= Endpoint_IsOUTReceived() && !(serialPending);
+
+	MassStorage_Task();
+	HID_Task();
+	USB_USBTask();
+
+	if (Pending)
+	  Scheduler_Post(EVENT_USB);
+}
+
 void configSerial(void) {
 	/* Must turn off USART before reconfiguring it, otherwise incorrect operation may occur */
 	UCSR1B = 0;
@@ -177,6 +204,10 @@ void SetupHardware(void)
 
 	/* Start the flush timer so that overflows occur rapidly to push received bytes to the USB interface */
 	TCCR0B = (1 << CS02);
+	TIMSK0 = (1 << TOIE0);
+
+	/* Start the free-running timebase used for target timeouts */
+	TCCR1B = (1 << CS12) | (1 << CS10);
 	
 	/* Pull target /RESET line high */
 	AVR_RESET_LINE_PORT |= AVR_RESET_LINE_MASK;
@@ -192,6 +223,7 @@ void EVENT_USB_Device_Connect(void)
 /** Event handler for the library USB Disconnection event. */
 void EVENT_USB_Device_Disconnect(void)
 {
+	serialPending = 0;
 	LEDs_SetAllLEDs(LEDMASK_NOTREADY);
 }
 
@@ -200,21 +232,47 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 {
 	bool ConfigSuccess = true;
 
-	ConfigSuccess &= MS_Device_ConfigureEndpoints(&Disk_MS_Interface);
+	/* Serial data left in the old HID OUT endpoint is gone with it */
+	serialPending = 0;
+
+	ConfigSuccess &= MassStorage_ConfigureEndpoints();
 
-	ConfigSuccess &= Endpoint_ConfigureEndpoint(HID_IN_EPADDR, EP_TYPE_INTERRUPT, HID_IO_EPSIZE, 1);
-	ConfigSuccess &= Endpoint_ConfigureEndpoint(HID_OUT_EPADDR, EP_TYPE_INTERRUPT, HID_IO_EPSIZE, 1);
+	ConfigSuccess &= Endpoint_ConfigureEndpoint(HID_IN_EPADDR, HID_IO_EPTYPE, HID_IO_EPSIZE, 1);
+	ConfigSuccess &= Endpoint_ConfigureEndpoint(HID_OUT_EPADDR, HID_IO_EPTYPE, HID_IO_EPSIZE, 1);
 	LEDs_SetAllLEDs(ConfigSuccess ? LEDMASK_READY : LEDMASK_ERROR);
+
+	/* Poll the endpoints on every frame from now on */
+	USB_Device_EnableSOFEvents();
+}
+
+/** Event handler for the library USB Start of Frame event, fired every millisecond once configured. */
+void EVENT_USB_Device_StartOfFrame(void)
+{
+	Scheduler_Post(EVENT_USB);
 }
 
 /** Event handler for the library USB Control Request reception event. */
 void EVENT_USB_Device_ControlRequest(void)
 {
-	MS_Device_ProcessControlRequest(&Disk_MS_Interface);
+	MassStorage_ProcessControlRequest();
 
-	/* Handle HID Class specific requests */
+	/* Handle HID Class specific requests, or the Microsoft OS 2.0 request of the bulk HF2 interface */
 	switch (USB_ControlRequest.bRequest)
 	{
+		#if HF2_BULK
+		case MS_OS_20_VENDOR_CODE:
+			if ((USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE)) &&
+			    (USB_ControlRequest.wIndex == MS_OS_20_DESCRIPTOR_INDEX))
+			{
+				Endpoint_ClearSETUP();
+
+				/* Write the descriptor set from flash, truncated to the length the host asked for */
+				Endpoint_Write_Control_PStream_LE(&MS_OS_20_DescriptorSet, sizeof(MS_OS_20_DescriptorSet));
+				Endpoint_ClearOUT();
+			}
+
+			break;
+		#else
 		case HID_REQ_GetReport:
 			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE))
 			{
@@ -237,39 +295,29 @@ void EVENT_USB_Device_ControlRequest(void)
 			}
 
 			break;
+		#endif
 	}
 
 }
 
-/** Mass Storage class driver callback function the reception of SCSI commands from the host, which must be processed.
- *
- *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface configuration structure being referenced
- */
-bool CALLBACK_MS_Device_SCSICommandReceived(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
-{
-	bool CommandSuccess;
-
-	LEDs_TurnOnLEDs(LEDMASK_MSD);
-	CommandSuccess = SCSI_DecodeSCSICommand(MSInterfaceInfo);
-	LEDs_TurnOffLEDs(LEDMASK_MSD);
-
-	return CommandSuccess;
-}
-
-
-volatile uint8_t recv_STK_OK = 0;
-
 /** ISR to manage the reception of data from the serial port, placing received bytes into a circular buffer
- *  for later transmission to the host.
+ *  for later transmission to the host. While the target is being programmed its bytes are bootloader
+ *  responses instead, and are handed to the STK500 response parser.
  */
 ISR(USART1_RX_vect, ISR_BLOCK)
 {
 	uint8_t ReceivedByte = UDR1;
 
-	if (ReceivedByte == 0x10)
-		recv_STK_OK++;
-
-	if (USB_DeviceState == DEVICE_STATE_Configured) {
+	if (STK500_InProgMode) {
+		STK500_ReceiveByte(ReceivedByte);
+	} else if (USB_DeviceState == DEVICE_STATE_Configured) {
  		RingBuffer_Insert(&USARTtoUSB_Buffer, ReceivedByte);
+		Scheduler_Post(EVENT_SERIAL_RX);
 	}
 }
+
+/** ISR for the serial flush timer, which also paces LED pulses and target timeouts. */
+ISR(TIMER0_OVF_vect, ISR_BLOCK)
+{
+	Scheduler_Post(EVENT_TICK);
+}
@@ -45,9 +45,12 @@
 
 		#include "Descriptors.h"
 
+		#include "Lib/MassStorage.h"
 		#include "Lib/SCSI.h"
 		#include "Lib/DataflashManager.h"
+		#include "Lib/STK500.h"
 		#include "Lib/LightweightRingBuff.h"
+		#include "Lib/Scheduler.h"
 		#include "Config/AppConfig.h"
 
 		#include <LUFA/Drivers/Board/LEDs.h>
@@ -71,29 +74,86 @@
 		#define LEDMASK_NOTREADY LEDMASK_ERROR
 		#define LEDMASK_READY 0
 
+		/** Current time of the free-running TIMER1, which ticks at F_CPU / 1024 and wraps every 4 seconds. */
+		#define TIMER_NOW()              TCNT1
+
+		/** Number of TIMER1 ticks in the given number of milliseconds. */
+		#define TIMER_TICKS(ms)          ((uint16_t)((ms) * (F_CPU / 1024UL) / 1000))
+
+	/* Type Defines: */
+		/** Type define for the event counters of the firmware, which can be read over HID with \c HF2_CMD_COUNTERS. */
+		typedef struct
+		{
+			uint16_t PageRetries; /**< Pages re-sent after the target failed to acknowledge them */
+			uint16_t TargetResets; /**< Times the target was reset to get it back in sync */
+			uint16_t PageFailures; /**< Pages given up on after all retries */
+			uint16_t BadResponses; /**< STK_FAILED, STK_NOSYNC or malformed responses from the target */
+			uint16_t DuplicateBlocks; /**< UF2 blocks written again by the host and not reprogrammed */
+			uint16_t TrackerOverflows; /**< Sessions written too far out of order to track their completion */
+			uint16_t CountCompletions; /**< Sessions completed once all their UF2 blocks were written */
+			uint16_t IdleCompletions; /**< Sessions completed after the host stopped writing for a while */
+			uint16_t ForeignBlocks; /**< UF2 blocks skipped because they are meant for another family of boards */
+			uint16_t SkippedPages; /**< Pages not programmed because the target already holds them */
+			uint16_t VerifyFailures; /**< Pages that read back different from what was programmed */
+			uint16_t OutOfOrderPages; /**< Pages refused because the bootloader only takes them in order */
+		} Counters_t;
+
 	/* Function Prototypes: */
 		void SetupHardware(void);
 
+		#if defined(INCLUDE_FROM_UF2UNO_C)
+			static void Serial_Task(void);
+			static void USB_Tasks(void);
+		#endif
+
 		void EVENT_USB_Device_Connect(void);
 		void EVENT_USB_Device_Disconnect(void);
 		void EVENT_USB_Device_ConfigurationChanged(void);
 		void EVENT_USB_Device_ControlRequest(void);
+		void EVENT_USB_Device_StartOfFrame(void);
 		void HID_Task(void);
+		bool HID_IsResetting(void);
 		void logChar(char c);
 
-/** Circular buffer to hold data from the host before it is sent to the device via the serial port. */
-extern RingBuff_t USBtoUSART_Buffer;
-
 /** Circular buffer to hold data from the serial port before it is sent to the host. */
 extern RingBuff_t USARTtoUSB_Buffer;
 
 extern uint8_t needsFlush;
 
+extern uint8_t serialPending;
+
+extern Counters_t Counters;
+
 
 #define UF2_VERSION "v0.1.0 U"
+#if defined(TARGET_MEGA2560)
+#define PRODUCT_NAME "Arduino Mega 2560"
+#define BOARD_ID "ATmega2560-MegaR3-v0"
+#define VOLUME_LABEL "MEGA BOOT"
+// flash page size and flash size of the target, not of the 16u2
+#define TARGET_PAGESIZE 256
+// the bootloader erases the page after the last one it programmed since it started on each program
+// command, whatever the address loaded, so pages go to it in order from address 0, each in one
+// command - streamed in half-page chunks, which keeps the page buffer within our RAM
+#define TARGET_CHUNKSIZE 128
+#define TARGET_SEQUENTIAL_PAGES true
+#define TARGET_FLASH_SIZE (256 * 1024UL)
+#define TARGET_EEPROM_SIZE 4096
+#define TARGET_BOOTLOADER_SIZE 8192
+#define UF2_FAMILY_ID 0x5e8b2c41
+#else
 #define PRODUCT_NAME "Arduino Uno"
 #define BOARD_ID "ATmega328p-UnoR3-v0"
 #define VOLUME_LABEL "UNO BOOT"
+#define TARGET_PAGESIZE 128
+// optiboot erases and writes a whole page on each STK_PROG_PAGE, wherever the address loaded
+#define TARGET_CHUNKSIZE TARGET_PAGESIZE
+#define TARGET_SEQUENTIAL_PAGES false
+#define TARGET_FLASH_SIZE (32 * 1024UL)
+#define TARGET_EEPROM_SIZE 1024
+#define TARGET_BOOTLOADER_SIZE 512
+#define UF2_FAMILY_ID 0x90f17162
+#endif
 #define INDEX_URL "https://pxt.io"
 
 #endif